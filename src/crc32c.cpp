@@ -0,0 +1,113 @@
+#include "crc32c.h"
+
+#include <array>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FINELOG_CRC32C_X86
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define FINELOG_CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
+namespace {
+
+// Reflected form of the Castagnoli polynomial 0x1EDC6F41
+constexpr uint32_t Polynomial = 0x82f63b78;
+
+struct CrcTable {
+    std::array<uint32_t, 256> entries;
+
+    CrcTable()
+    {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? (c >> 1) ^ Polynomial : c >> 1;
+            }
+            entries[i] = c;
+        }
+    }
+};
+
+uint32_t crc32c_table(uint32_t crc, const uint8_t* p, size_t length)
+{
+    static const CrcTable table;
+    while (length-- > 0) {
+        crc = table.entries[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef FINELOG_CRC32C_X86
+// Compiled for SSE4.2 regardless of the compiler flags; only called if the
+// CPU supports it
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t length)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (length >= 8) {
+        uint64_t word;
+        __builtin_memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        length -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+    while (length >= 4) {
+        uint32_t word;
+        __builtin_memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        length -= 4;
+    }
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+bool detect_hw() { return __builtin_cpu_supports("sse4.2"); }
+#elif defined(FINELOG_CRC32C_ARM)
+uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t length)
+{
+    while (length >= 8) {
+        uint64_t word;
+        __builtin_memcpy(&word, p, 8);
+        crc = __crc32cd(crc, word);
+        p += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+
+bool detect_hw() { return true; }
+#else
+uint32_t crc32c_hw(uint32_t crc, const uint8_t* p, size_t length)
+{
+    return crc32c_table(crc, p, length);
+}
+
+bool detect_hw() { return false; }
+#endif
+
+} // anonymous namespace
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+{
+    static const bool hwEnabled = detect_hw();
+    auto p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    crc = hwEnabled ? crc32c_hw(crc, p, length) : crc32c_table(crc, p, length);
+    return ~crc;
+}
+
+bool crc32c_hw_enabled()
+{
+    return detect_hw();
+}
@@ -0,0 +1,19 @@
+#ifndef FINELOG_CRC32C_H
+#define FINELOG_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * CRC-32C (Castagnoli polynomial), as used by iSCSI and ext4. Uses the
+ * SSE4.2 or ARMv8 CRC instructions if the CPU supports them, and a lookup
+ * table otherwise. Checksums may be computed incrementally: passing the
+ * result of a previous call as crc continues the checksum over the
+ * concatenation of both inputs (the initial value is 0).
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+// Whether crc32c uses hardware instructions
+bool crc32c_hw_enabled();
+
+#endif
@@ -1,38 +1,90 @@
 #ifndef FINELOG_EPOCH_TRACKER_H
 #define FINELOG_EPOCH_TRACKER_H
 
-#include <array>
+#include <algorithm>
 #include <atomic>
+#include <memory>
+#include <thread>
 
-template <typename Epoch = uint64_t, size_t ArraySize = 8192>
+#include "finelog_basics.h"
+#include "futex.h"
+
+/**
+ * \brief Tracks which epochs still have threads active in them
+ *
+ * The number of threads in each epoch is split into one counter per shard,
+ * and every counter is in its own cache line, so that threads entering the
+ * current epoch or leaving older ones do not contend on the same cache line.
+ * There is one shard per hardware thread (up to MaxShards), and each thread
+ * uses the shard assigned to it round-robin the first time it acquires an
+ * epoch. An epoch is only inactive once the counters of all shards are zero,
+ * which is checked when epochs are recycled (i.e., when advancing the epoch)
+ * rather than when querying the lowest active epoch.
+ *
+ * At most ArraySize - 2 epochs can be active at a time. If advance_epoch
+ * finds the window full, it sleeps until a thread leaves the lowest epoch.
+ */
+template <typename Epoch = uint64_t, size_t ArraySize = 512, size_t MaxShards = 128>
 class EpochTracker
 {
 private:
-    using Counter = std::atomic<size_t>;
-    std::array<Counter, ArraySize> slots;
-    std::atomic<Epoch> first;
-    std::atomic<Epoch> last;
+    struct alignas(CACHELINE_SIZE) Counter {
+        std::atomic<size_t> value;
+    };
+
+    const size_t shard_count;
+    // Counters of the same epoch are adjacent, so that recycling an epoch
+    // reads consecutive cache lines
+    std::unique_ptr<Counter[]> counters;
+
+    alignas(CACHELINE_SIZE) std::atomic<Epoch> first;
+    alignas(CACHELINE_SIZE) std::atomic<Epoch> last;
+
+    // Signaled when a thread leaves the lowest active epoch while
+    // advance_epoch waits for the window to have room
+    alignas(CACHELINE_SIZE) FutexEvent window_event;
+    std::atomic<unsigned> window_waiters;
+
+    std::atomic<size_t>& get_slot(size_t shard, Epoch e)
+    {
+        return counters[(e % ArraySize) * shard_count + shard].value;
+    }
+
+    size_t my_shard()
+    {
+        static std::atomic<size_t> next_shard {0};
+        thread_local size_t shard = next_shard++;
+        return shard % shard_count;
+    }
 
-    Counter& get_slot(Epoch e) { return slots[e % ArraySize]; }
+    static size_t default_shard_count()
+    {
+        size_t hw = std::thread::hardware_concurrency();
+        return std::min(std::max<size_t>(hw, 1), MaxShards);
+    }
 
     static constexpr size_t invalid_value = ~0ul;
 
 public:
-    EpochTracker()
+    EpochTracker(size_t shards = default_shard_count())
+        : shard_count(shards), counters(new Counter[ArraySize * shards]),
+        window_waiters(0)
     {
+        w_assert0(shards > 0);
         // invariants: last > first && first > 0
         first = 1;
         last = 2;
-        for (size_t i = 0; i < ArraySize; i++) {
-            slots[i] = 0;
+        for (size_t i = 0; i < ArraySize * shard_count; i++) {
+            counters[i].value = 0;
         }
     };
 
     Epoch acquire()
     {
+        auto shard = my_shard();
         while (true) {
             auto current = last.load();
-            auto& slot = get_slot(current);
+            auto& slot = get_slot(shard, current);
             auto old = slot.load();
             if (old != invalid_value && slot.compare_exchange_strong(old, old+1)) {
                 return current;
@@ -40,11 +92,26 @@ public:
         }
     }
 
+    /*
+     * Usually called by the thread that acquired the epoch, in which case
+     * the counter of its own shard is decremented. Otherwise, any shard
+     * which has a thread in the epoch is decremented instead.
+     */
     void release(Epoch e)
     {
-        auto& slot = get_slot(e);
-        w_assert1(slot.load() > 0 && slot.load() != invalid_value);
-        --slot;
+        auto shard = my_shard();
+        for (size_t i = 0; i < shard_count; i++) {
+            auto& slot = get_slot((shard + i) % shard_count, e);
+            auto old = slot.load();
+            while (old > 0 && old != invalid_value) {
+                if (slot.compare_exchange_weak(old, old-1)) {
+                    if (window_waiters.load() > 0) { window_event.signal(); }
+                    return;
+                }
+            }
+        }
+        // epoch was not acquired
+        w_assert1(false);
     }
 
     Epoch get_lowest_active_epoch()
@@ -55,16 +122,28 @@ public:
 
     Epoch advance_epoch()
     {
+        // epochs don't overlap and at least one is reserved for resetting below
+        try_recycle();
         while (last - first >= ArraySize - 2) {
-            // epochs don't overlap and at least one is reserved for resetting below
-            std::this_thread::yield();
+            window_waiters++;
+            auto ticket = window_event.prepare();
             try_recycle();
+            if (last - first >= ArraySize - 2) {
+                // Timeout only guards against concurrent advance_epoch calls,
+                // which may recycle without signaling
+                constexpr long timeoutMs = 10;
+                window_event.wait(ticket, timeoutMs);
+            }
+            else { window_event.cancel(); }
+            window_waiters--;
         }
         auto ret = last++;
         try_recycle();
         // Reset value of future epoch (from invalid_value to zero)
         w_assert1(last+1 != first);
-        get_slot(last+1) = 0;
+        for (size_t s = 0; s < shard_count; s++) {
+            get_slot(s, last+1) = 0;
+        }
         return ret;
     }
 
@@ -73,13 +152,23 @@ private:
     void try_recycle()
     {
         while (first < last-2) {
-            auto& slot = get_slot(first);
-            if (slot > 0) { return; }
-            size_t expected = 0;
-            if (slot.compare_exchange_strong(expected, invalid_value)) {
-                first++;
+            auto e = first.load();
+            // Invalidate the counters of all shards, so that no thread can
+            // enter the epoch anymore, or undo it if any thread is still in
+            // there. Shards are invalidated in order, so concurrent callers
+            // give up as soon as they get to the first shard.
+            size_t s = 0;
+            for (; s < shard_count; s++) {
+                size_t expected = 0;
+                if (!get_slot(s, e).compare_exchange_strong(expected, invalid_value)) {
+                    break;
+                }
+            }
+            if (s < shard_count) {
+                while (s > 0) { get_slot(--s, e) = 0; }
+                return;
             }
-            else { return; }
+            first++;
         }
     }
 };
@@ -40,7 +40,32 @@ typedef uint32_t    PageID;
 typedef uint32_t    StoreID;
 
 // Used in log archive
-typedef int32_t run_number_t;
+typedef int64_t run_number_t;
+
+/*
+ * A run number holds the log partition number in its upper bits and a
+ * sub-partition sequence number in its lower RunSubBits bits, so that archive
+ * runs may end before the log partition does. The run that covers the rest of
+ * a partition always ends with RunSubMax, so a run of whole partitions is
+ * [make_run_number(P, 0), make_run_number(Q, RunSubMax)].
+ */
+constexpr unsigned RunSubBits = 16;
+constexpr uint32_t RunSubMax = (1u << RunSubBits) - 1;
+
+inline run_number_t make_run_number(uint32_t partition, uint32_t sub)
+{
+    return (static_cast<run_number_t>(partition) << RunSubBits) | sub;
+}
+
+inline uint32_t run_partition(run_number_t run)
+{
+    return static_cast<uint32_t>(run >> RunSubBits);
+}
+
+inline uint32_t run_sub(run_number_t run)
+{
+    return static_cast<uint32_t>(run & RunSubMax);
+}
 
 /**
 * \brief CPU Cache line size in bytes.
@@ -0,0 +1,135 @@
+#ifndef FINELOG_FUTEX_H
+#define FINELOG_FUTEX_H
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Thin wrappers around the Linux futex system call, used to sleep on a
+ * 32-bit atomic word. futex_wait only blocks if the word still holds the
+ * expected value, so a wakeup issued between checking a condition and going
+ * to sleep is not lost, as long as the waker modifies the word before waking.
+ * Spurious wakeups are possible, so callers must always re-check their
+ * condition.
+ */
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+        "futex word must be a plain 32-bit integer");
+
+// Negative timeout means no timeout
+inline void futex_wait(std::atomic<uint32_t>* addr, uint32_t expected, long timeoutMs = -1)
+{
+    struct timespec ts;
+    struct timespec* tsp = nullptr;
+    if (timeoutMs >= 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+        tsp = &ts;
+    }
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE,
+            expected, tsp, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<uint32_t>* addr, int count = INT_MAX)
+{
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE,
+            count, nullptr, nullptr, 0);
+}
+
+/**
+ * \brief Event counter on which threads may sleep until it is signaled
+ *
+ * Waiters read the current value with prepare(), check their condition, and
+ * then call wait() with the value read. Signalers modify the state that the
+ * condition depends on and then call signal(). The futex system call is
+ * only issued if there are waiters.
+ */
+class FutexEvent {
+public:
+    FutexEvent() : seq(0), waiters(0) {}
+
+    uint32_t prepare()
+    {
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        return seq.load(std::memory_order_seq_cst);
+    }
+
+    void cancel()
+    {
+        waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void wait(uint32_t ticket, long timeoutMs = -1)
+    {
+        futex_wait(&seq, ticket, timeoutMs);
+        waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void signal()
+    {
+        seq.fetch_add(1, std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_seq_cst) > 0) {
+            futex_wake(&seq);
+        }
+    }
+
+private:
+    std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> waiters;
+};
+
+/**
+ * \brief Publishes a monotonically increasing value, such as an LSN or a run
+ * number, to threads waiting for it to reach a certain target.
+ *
+ * Waits may be cut short with a timeout or with notify(), so callers that
+ * also depend on other conditions (e.g., a shutdown flag) should set them
+ * before calling notify() and check them after waitFor() returns.
+ */
+class SeqNotifier {
+public:
+    SeqNotifier(uint64_t value = 0) : value(value) {}
+
+    uint64_t get() const { return value.load(); }
+
+    // Values lower than the current one are ignored
+    void publish(uint64_t v)
+    {
+        auto current = value.load();
+        while (v > current && !value.compare_exchange_weak(current, v)) {}
+        event.signal();
+    }
+
+    // Wake up all waiters without changing the value
+    void notify() { event.signal(); }
+
+    /*
+     * Wait until the value is at least target, the timeout expires, or
+     * notify() is called; returns the current value. Spurious returns are
+     * possible, so callers should wait in a loop. Negative timeout means no
+     * timeout.
+     */
+    uint64_t waitFor(uint64_t target, long timeoutMs = -1)
+    {
+        auto ticket = event.prepare();
+        if (value.load() >= target) {
+            event.cancel();
+        }
+        else {
+            event.wait(ticket, timeoutMs);
+        }
+        return value.load();
+    }
+
+private:
+    std::atomic<uint64_t> value;
+    FutexEvent event;
+};
+
+#endif
@@ -62,6 +62,7 @@ Rome Research Laboratory Contract No. F30602-97-2-0247.
 // #include "xct_logger.h"
 
 #include <algorithm>
+#include <vector>
 #include <sstream>
 #include <fstream>
 
@@ -69,6 +70,7 @@ Rome Research Laboratory Contract No. F30602-97-2-0247.
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -161,6 +163,9 @@ void LogManager::shutdown()
     _flush_daemon_running = false;
     delete _flush_daemon;
     _flush_daemon=NULL;
+
+    // Flush daemon emptied the log buffer before exiting
+    _complete_flushes(std::numeric_limits<uint64_t>::max());
 }
 
 /*********************************************************************
@@ -172,8 +177,11 @@ void LogManager::shutdown()
  *  from the last log file.
  *
  *********************************************************************/
-LogManager::LogManager(const std::string& logdir, bool reformat, bool delete_old_partitions, size_t partition_size)
+LogManager::LogManager(const std::string& logdir, bool reformat, bool delete_old_partitions, size_t partition_size,
+        bool direct_io, std::shared_ptr<StorageBackend> backend)
     :
+      _durable_epoch(0),
+      _pending_epoch_completions(0),
       _start(0),
       _end(0),
       _waiting_for_flush(false),
@@ -193,14 +201,56 @@ LogManager::LogManager(const std::string& logdir, bool reformat, bool delete_old
     /* Create thread o flush the log */
     _flush_daemon = new flush_daemon_thread_t(this);
 
-    _buf = new char[_segsize];
+    // directIO = options.get_bool_option("sm_log_o_direct", false);
+    directIO = direct_io;
+
+    // bool mirrored = options.get_bool_option("sm_log_mirrored_buffer", true);
+    bool mirrored = true;
+    if (mirrored && MirroredBuffer::isValidSize(_segsize)) {
+        _mirror.reset(new MirroredBuffer(_segsize));
+        _buf = _mirror->data();
+    }
+    else {
+        // Page-aligned, as required for direct I/O from the buffer
+        void* addr = ::mmap(nullptr, _segsize, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) { CHECK_ERRNO(-1); }
+        _buf = static_cast<char*>(addr);
+    }
 
-    _storage = new log_storage(logdir, reformat, delete_old_partitions, partition_size);
+    // bool hugepages = options.get_bool_option("sm_log_hugepage_buffer", true);
+    bool hugepages = true;
+    if (hugepages) {
+        // Fewer TLB misses on inserts and flushes. Only a hint, which may
+        // be ignored (e.g., for the memfd of a mirrored buffer, unless
+        // shmem huge pages are enabled), so errors are ignored.
+        ::madvise(_buf, _mirror ? 2 * _segsize : _segsize, MADV_HUGEPAGE);
+    }
 
+    if (!backend) {
+        // backend = StorageBackend::create(options.get_string_option("sm_log_storage_backend", "posix"));
+        backend = StorageBackend::create("posix");
+    }
+
+    _storage = new log_storage(logdir, reformat, delete_old_partitions, partition_size, directIO,
+            backend);
+
+    // Resume appending to the last partition if its log ends cleanly;
+    // otherwise start a new one
     auto curr_p = _storage->curr_partition();
-    auto pnum = (curr_p ? curr_p->num() : 0) + 1;
-    auto p = _storage->create_partition(pnum);
-    _curr_lsn = _durable_lsn = _flush_lsn = lsn_t(pnum, 0);
+    long end = curr_p ? curr_p->find_end() : -1;
+    partition_number_t pnum;
+    if (end >= 0 && end < _storage->get_partition_size()) {
+        pnum = curr_p->num();
+        _storage->wakeup_recycler();
+    }
+    else {
+        pnum = (curr_p ? curr_p->num() : 0) + 1;
+        _storage->create_partition(pnum);
+        end = 0;
+    }
+    _curr_lsn = _durable_lsn = _flush_lsn = lsn_t(pnum, end);
+    _durable_notifier.publish(_durable_lsn.data());
     cerr << "Initialized curr_lsn to " << _curr_lsn << endl;
 
     // _oldest_lsn_tracker = new PoorMansOldestLsnTracker(1 << 20);
@@ -222,6 +272,16 @@ LogManager::LogManager(const std::string& logdir, bool reformat, bool delete_old
     _buf_epoch = _cur_epoch = epoch(start_lsn, base, offset, offset);
     _end = _start = _durable_lsn.lo();
 
+    // Flushes may start at the beginning of an I/O unit (see
+    // partition_t::flush), so the part of the last unit before the durable
+    // LSN must be in the buffer
+    long delta = offset % _storage->get_io_unit();
+    if (delta > 0) {
+        auto p = _storage->curr_partition();
+        auto bytes = p->read_block(_buf + offset - delta, delta, _durable_lsn.lo() - delta);
+        w_assert0(bytes == static_cast<size_t>(delta));
+    }
+
     _ticker = NULL;
     // CS TODO: replace sm_options
     // if (options.get_bool_option("sm_ticker_enable", false)) {
@@ -237,9 +297,6 @@ LogManager::LogManager(const std::string& logdir, bool reformat, bool delete_old
     _group_commit_timeout = 0;
     _page_img_compression = 0;
 
-    // directIO = options.get_bool_option("sm_log_o_direct", false);
-    directIO = false;
-
     if (1) {
         cerr << "Log _start " << start_byte() << " end_byte() " << end_byte() << endl
             << "Log _curr_lsn " << _curr_lsn << " _durable_lsn " << _durable_lsn << endl;
@@ -275,7 +332,8 @@ LogManager::~LogManager()
     delete _storage;
     // delete _oldest_lsn_tracker;
 
-    delete [] _buf;
+    if (_mirror) { _mirror.reset(); }
+    else { ::munmap(_buf, _segsize); }
     _buf = NULL;
 
     delete _carray;
@@ -520,6 +578,8 @@ lsn_t LogManager::_copy_to_buffer(logrec_t &rec, long pos, long recsize, CArrayS
     lsn_t rlsn = info->lsn + pos;
     // CS FINELINE TODO: xct_end must have lsn as member; fix log priming
     // rec.set_lsn_ck(rlsn);
+    // Checksum is seeded with the partition, which is only known now
+    rec.set_checksum(rlsn.hi());
 
     _copy_raw(info, pos, (char const*) &rec, recsize);
 
@@ -662,10 +722,37 @@ void LogManager::insert_raw(const char* src, size_t length, lsn_t* rlsn)
 
     // insert my value
     // if(!info->error) {
-        if (rlsn) { *rlsn = info->lsn + pos; }
+        lsn_t lsn = info->lsn + pos;
+        if (rlsn) { *rlsn = lsn; }
         _copy_raw(info, pos, src, length);
     // }
 
+    // Log records must carry checksums seeded with their partition (see
+    // _copy_to_buffer), so they are stamped in the log buffer, where pos
+    // now points to
+    for (size_t p = 0; p < length; ) {
+        auto lr = reinterpret_cast<const logrec_t*>(src + p);
+        w_assert1(lr->valid_header());
+        size_t lrlength = lr->length();
+        long bpos = pos + p;
+        if (bpos >= _segsize) { bpos -= _segsize; }
+
+        if (_mirror || bpos + static_cast<long>(lrlength) <= _segsize) {
+            reinterpret_cast<logrec_t*>(_buf + bpos)->set_checksum(lsn.hi());
+        }
+        else {
+            // Record wraps around the end of the buffer, so it is stamped
+            // on a copy, which is written again in two parts
+            alignas(logrec_t) char copy[sizeof(logrec_t)];
+            memcpy(copy, lr, lrlength);
+            reinterpret_cast<logrec_t*>(copy)->set_checksum(lsn.hi());
+            long partsize = _segsize - bpos;
+            memcpy(_buf + bpos, copy, partsize);
+            memcpy(_buf, copy + partsize, lrlength - partsize);
+        }
+        p += lrlength;
+    }
+
     _leave_carray(info, length);
 
     // INC_TSTAT(log_inserts);
@@ -708,8 +795,9 @@ void LogManager::_copy_raw(CArraySlot* info, long& pos, const char* data,
         pos -= _segsize;
 
     long spillsize = pos + size - _segsize;
-    if(spillsize <= 0) {
-        // normal insert
+    if(spillsize <= 0 || _mirror) {
+        // normal insert -- with a mirrored buffer, the part that wraps
+        // around is written into the second mapping
         memcpy(_buf+pos, data, size);
     }
     else {
@@ -800,6 +888,77 @@ void LogManager::flush(const lsn_t &to_lsn, bool block, bool signal, bool *ret_f
     }
 }
 
+void LogManager::flush_async(const lsn_t& to_lsn, flush_callback_t callback)
+{
+    // don't wait for a flush past end of log (see flush)
+    lsn_t lsn = std::min(to_lsn, (*&_curr_lsn)+ -1);
+
+    lsn_t durable;
+    {
+        // Flush daemon updates _durable_lsn before acquiring the mutex in
+        // _complete_flushes, so the callback cannot be missed
+        std::unique_lock<std::mutex> lck{_completion_mutex};
+        durable = _durable_lsn;
+        if (lsn >= durable) {
+            _lsn_completions.emplace(lsn, std::move(callback));
+            return;
+        }
+    }
+    // INC_TSTAT(log_dup_sync_cnt);
+    callback(durable);
+}
+
+std::future<lsn_t> LogManager::flush_future(const lsn_t& lsn)
+{
+    auto promise = std::make_shared<std::promise<lsn_t>>();
+    auto future = promise->get_future();
+    flush_async(lsn, [promise] (lsn_t durable) { promise->set_value(durable); });
+    return future;
+}
+
+void LogManager::flush_epoch_async(uint64_t epoch, flush_callback_t callback)
+{
+    lsn_t durable;
+    {
+        std::unique_lock<std::mutex> lck{_completion_mutex};
+        if (epoch > _durable_epoch) {
+            _epoch_completions.emplace(epoch, std::move(callback));
+            _pending_epoch_completions = _epoch_completions.size();
+            return;
+        }
+        durable = _durable_lsn;
+    }
+    callback(durable);
+}
+
+void LogManager::_complete_flushes(uint64_t durable_epoch)
+{
+    std::vector<flush_callback_t> ready;
+    lsn_t durable = _durable_lsn;
+    {
+        std::unique_lock<std::mutex> lck{_completion_mutex};
+        if (durable_epoch > _durable_epoch) { _durable_epoch = durable_epoch; }
+
+        // Collect callbacks in LSN order and invoke them outside the mutex
+        auto end = _lsn_completions.lower_bound(durable);
+        for (auto it = _lsn_completions.begin(); it != end; it++) {
+            ready.push_back(std::move(it->second));
+        }
+        _lsn_completions.erase(_lsn_completions.begin(), end);
+
+        auto eend = _epoch_completions.upper_bound(_durable_epoch);
+        for (auto it = _epoch_completions.begin(); it != eend; it++) {
+            ready.push_back(std::move(it->second));
+        }
+        _epoch_completions.erase(_epoch_completions.begin(), eend);
+        _pending_epoch_completions = _epoch_completions.size();
+    }
+
+    for (auto& callback : ready) {
+        callback(durable);
+    }
+}
+
 /**\brief Log-flush daemon driver.
  * \details
  * This method handles the wait/block of the daemon thread,
@@ -855,6 +1014,18 @@ void LogManager::flush_daemon()
         // success=true if we wrote anything
         success = (lsn != last_completed_flush_lsn);
         last_completed_flush_lsn = lsn;
+
+        if (!success && _pending_epoch_completions > 0) {
+            // Nothing else to flush, so epoch waiters must not wait for more
+            // log to be inserted. All epochs older than the lowest active
+            // one have no inserts in flight, and all completed inserts are
+            // durable if nothing is left in the log buffer.
+            auto lowest = _epoch_tracker.get_lowest_active_epoch();
+            if (_durable_lsn >= *&_curr_lsn) {
+                _epoch_tracker.advance_epoch();
+                _complete_flushes(lowest - 1);
+            }
+        }
     }
 
     // make sure the buffer is completely empty before leaving...
@@ -899,6 +1070,13 @@ lsn_t LogManager::flush_daemon_work(lsn_t old_mark)
 {
     lsn_t base_lsn_before, base_lsn_after;
     long base, start1, end1, start2, end2, write_size;
+    // Epochs older than the lowest active one have no inserts in flight, but
+    // a thread may leave its epoch before the last thread of its carray slot
+    // publishes the slot's records for flushing (see _leave_carray). These
+    // epochs are thus only durable once the flush reaches the insertion
+    // point observed after the lowest active epoch.
+    uint64_t durable_epoch = _epoch_tracker.get_lowest_active_epoch() - 1;
+    lsn_t durable_epoch_lsn = _curr_lsn;
     {
         CRITICAL_SECTION(cs, _flush_lock);
         base_lsn_before = _old_epoch.base_lsn;
@@ -965,6 +1143,8 @@ lsn_t LogManager::flush_daemon_work(lsn_t old_mark)
 
             // Mark the old epoch has no longer valid.
             _old_epoch.start = end1;
+            // New epoch is not flushed
+            durable_epoch = 0;
 
             w_assert1(base_lsn_before.file()+1 == base_lsn_after.file());
         }
@@ -993,15 +1173,26 @@ lsn_t LogManager::flush_daemon_work(lsn_t old_mark)
             start2, end2);
 
     // Flush the log buffer
-    p->flush(start_lsn, _buf, start1, end1, start2, end2);
+    if (_mirror && end1 == segsize() && start2 == 0 && end2 > 0) {
+        // wrapped within partition: the new epoch follows the old one in
+        // the second mapping of the buffer, so write both with one range
+        p->flush(start_lsn, _buf, start1, end1 + end2, 0, 0);
+    }
+    else {
+        p->flush(start_lsn, _buf, start1, end1, start2, end2);
+    }
     write_size = (end2 - start2) + (end1 - start1);
 
     _durable_lsn = end_lsn;
+    _durable_notifier.publish(end_lsn.data());
     _start = new_start;
     _epoch_tracker.advance_epoch();
     // For eviction purposes, epoch associated with the log file must be the lowest active, and not current!
     _log_file_epochs[p->num()] = _epoch_tracker.get_lowest_active_epoch() - 1;
 
+    // Zero keeps the durable epoch unchanged
+    _complete_flushes(end_lsn >= durable_epoch_lsn ? durable_epoch : 0);
+
     _group_commit_timer.reset();
 
     return end_lsn;
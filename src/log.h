@@ -62,6 +62,10 @@ Rome Research Laboratory Contract No. F30602-97-2-0247.
 #include <limits>
 #include <atomic>
 #include <unordered_map>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <future>
 
 class partition_t;
 class sm_options;
@@ -77,11 +81,17 @@ class flush_daemon_thread_t;
 #include "log_storage.h"
 #include "stopwatch.h"
 #include "epoch_tracker.h"
+#include "mirrored_buffer.h"
+#include "futex.h"
 
 class LogManager
 {
 public:
-    LogManager(const std::string& logdir, bool reformat = false, bool delete_old_partitions = true, size_t partition_size = 1024);
+    // With direct_io, log partitions are written with O_DIRECT (see
+    // log_storage). Log files are accessed through the given backend, which
+    // is also used by consumers and archives of this log (see StorageBackend)
+    LogManager(const std::string& logdir, bool reformat = false, bool delete_old_partitions = true, size_t partition_size = 1024,
+            bool direct_io = false, std::shared_ptr<StorageBackend> backend = nullptr);
     virtual ~LogManager();
 
     void init();
@@ -91,6 +101,26 @@ public:
     void flush(const lsn_t &lsn, bool block=true, bool signal=true, bool *ret_flushed=NULL);
     void flush_all(bool block=true) { return flush(curr_lsn().advance(-1), block); }
 
+    /*
+     * Asynchronous flush: the callback is invoked, with the durable LSN as
+     * argument, once the given LSN is durable. Completions are invoked by
+     * the flush daemon in batches, in LSN order, after each log write, so
+     * callbacks must be short and must never wait for a flush themselves.
+     * If the LSN is already durable, the callback is invoked right away by
+     * the calling thread.
+     */
+    using flush_callback_t = std::function<void(lsn_t)>;
+    void flush_async(const lsn_t& lsn, flush_callback_t callback);
+    std::future<lsn_t> flush_future(const lsn_t& lsn);
+
+    /*
+     * Epoch-based variant: the callback is invoked once all log records
+     * inserted by threads that acquired the given epoch from the epoch
+     * tracker (see get_epoch_tracker) are durable. This saves the caller from
+     * keeping track of the LSN of its last log record.
+     */
+    void flush_epoch_async(uint64_t epoch, flush_callback_t callback);
+
     // CS TODO: return const pointer
     logrec_t* fetch_direct(std::shared_ptr<partition_t> partition, lsn_t lsn);
 
@@ -101,6 +131,17 @@ public:
 
     lsn_t durable_lsn() const { return _durable_lsn; }
 
+    /*
+     * Waits until the durable LSN reaches lsn, the timeout expires, or
+     * notify_durable_waiters() is called, and returns the durable LSN. Used
+     * by log consumers (e.g., the log archiver) instead of polling.
+     */
+    lsn_t wait_for_durable(lsn_t lsn, long timeout_ms = -1)
+    {
+        return lsn_t(_durable_notifier.waitFor(lsn.data(), timeout_ms));
+    }
+    void notify_durable_waiters() { _durable_notifier.notify(); }
+
     void start_flush_daemon();
 
     long segsize() const { return _segsize; }
@@ -139,10 +180,28 @@ protected:
     char*                _buf; // log buffer: _segsize buffer into which
                          // inserts copy log records with LogManager::insert
 
+    // If set, _buf is mapped twice in a row, so that data wrapping around
+    // the end of the buffer is contiguous (see _copy_raw and flush_daemon_work)
+    std::unique_ptr<MirroredBuffer> _mirror;
+
     ticker_thread_t* _ticker;
 
     lsn_t           _curr_lsn;
     lsn_t           _durable_lsn;
+    SeqNotifier     _durable_notifier; // signaled by flush daemon
+
+    // Pending flush_async and flush_epoch_async completions, keyed by LSN and
+    // epoch, respectively, and protected by _completion_mutex
+    std::mutex _completion_mutex;
+    std::multimap<lsn_t, flush_callback_t> _lsn_completions;
+    std::multimap<uint64_t, flush_callback_t> _epoch_completions;
+    // All log inserted in this epoch or before is durable
+    uint64_t _durable_epoch;
+
+    std::atomic<size_t> _pending_epoch_completions;
+
+    // Invoked by the flush daemon once the durable LSN or epoch advances
+    void _complete_flushes(uint64_t durable_epoch);
 
     // Set of pointers into _buf (circular log buffer)
     // and associated lsns. See detailed comments at LogManager::insert
@@ -26,8 +26,9 @@ ReaderThread::ReaderThread(AsyncRingBuffer* readbuf, lsn_t startLSN, log_storage
 
 bool ReaderThread::openPartition()
 {
+    auto& backend = owner->get_backend();
     if (currentFd != -1) {
-        auto ret = ::close(currentFd);
+        auto ret = backend->close(currentFd);
         CHECK_ERRNO(ret);
     }
     currentFd = -1;
@@ -37,14 +38,12 @@ bool ReaderThread::openPartition()
     string fname = owner->make_log_name(nextPartition);
 
     int flags = O_RDONLY;
-    fd = ::open(fname.c_str(), flags, 0744 /*mode*/);
+    fd = backend->open(fname, flags, 0744 /*mode*/);
     CHECK_ERRNO(fd);
 
-    struct stat stat;
-    auto ret = ::fstat(fd, &stat);
-    CHECK_ERRNO(ret);
-    if (stat.st_size == 0) { return false; }
-    off_t partSize = stat.st_size;
+    off_t partSize = backend->file_size(fd);
+    CHECK_ERRNO(partSize);
+    if (partSize == 0) { return false; }
 
     /*
      * The size of the file must be at least the offset of endLSN, otherwise
@@ -68,6 +67,7 @@ bool ReaderThread::openPartition()
 void ReaderThread::do_work()
 {
     auto blockSize = getBlockSize();
+    auto& backend = owner->get_backend();
     // copy endLSN into local var to avoid it changing in-between steps below
     localEndLSN = getEndLSN();
 
@@ -122,7 +122,7 @@ void ReaderThread::do_work()
 
         // Read only the portion which was ignored on the last round
         size_t blockPos = pos % blockSize;
-        int bytesRead = ::pread(currentFd, dest + blockPos, blockSize - blockPos, pos);
+        int bytesRead = backend->pread(currentFd, dest + blockPos, blockSize - blockPos, pos);
         CHECK_ERRNO(bytesRead);
 
         if (bytesRead == 0) {
@@ -132,7 +132,7 @@ void ReaderThread::do_work()
             w_assert0(opened);
             pos = 0;
             blockPos = 0;
-            bytesRead = ::pread(currentFd, dest, blockSize, pos);
+            bytesRead = backend->pread(currentFd, dest, blockSize, pos);
             CHECK_ERRNO(bytesRead);
             if (bytesRead == 0) {
                 throw std::runtime_error("Error reading from partition");
@@ -158,9 +158,12 @@ LogConsumer::LogConsumer(lsn_t startLSN, size_t blockSize, log_storage* storage)
     // pos must be set to the correct offset within a block
     pos = startLSN.lo() % blockSize;
 
-    readbuf = new AsyncRingBuffer(blockSize, IO_BLOCK_COUNT);
+    // Log records crossing block boundaries are read in place if the read
+    // buffer can be mirrored
+    bool mirrored = MirroredBuffer::isValidSize(blockSize * IO_BLOCK_COUNT);
+    readbuf = new AsyncRingBuffer(blockSize, IO_BLOCK_COUNT, 0, mirrored);
     reader = new ReaderThread(readbuf, startLSN, storage);
-    logScanner = new LogScanner(blockSize);
+    logScanner = new LogScanner(blockSize, mirrored);
 
     reader->fork();
 }
@@ -216,9 +219,11 @@ bool LogConsumer::nextBlock()
     if (pos >= blockSize) {
         // If we are reading the same block but from a continued reader cycle,
         // pos should be maintained. For this reason, pos should be set to
-        // blockSize on constructor.
-        pos = 0;
+        // blockSize on constructor. In contiguous mode, the last log record
+        // may have ended inside this block.
+        pos -= blockSize;
     }
+    logScanner->setReadable(blockSize);
 
     return true;
 }
@@ -273,6 +278,18 @@ bool LogConsumer::next(logrec_t*& lr, lsn_t* lsn)
     // FINELINE
     // w_assert1(!scanned || lr->lsn_ck() + lr->length() == nextLSN);
 
+    if (!scanned && logScanner->isContiguous() && pos < blockSize
+            && logScanner->getReadable() == blockSize) {
+        // Log record crosses into the next block, which is right after the
+        // current one in memory
+        if (!readbuf->consumerRequestNext()) {
+            DBGTHRD(<< "LogConsumer next-block request failed");
+            return false;
+        }
+        logScanner->setReadable(2 * blockSize);
+        return next(lr, lsn);
+    }
+
     // CS TODO: support skip logrec with finelog
     if (!scanned || (lrLength > 0 && lr->is_eof())) {
         /*
@@ -327,10 +344,10 @@ tryagain:
     }
 
     // whole log record is not guaranteed to fit in a block
-    size_t remaining = blockSize - pos;
-    if (remaining == 0) {
+    if (pos >= blockSize) {
         return false;
     }
+    size_t remaining = (contiguous ? readable : blockSize) - pos;
 
     lr = (logrec_t*) (src + pos);
 
@@ -349,6 +366,15 @@ tryagain:
         DBG3(<< "Log record with length "
                 << (remaining >= sizeof(baseLogHeader) ? lr->length() : -1)
                 << " does not fit in current block of " << remaining);
+
+        if (contiguous) {
+            // Caller must make the next block readable; pos is kept
+            if (lrLength) {
+                *lrLength = (remaining >= sizeof(baseLogHeader)) ? lr->length() : -1;
+            }
+            return false;
+        }
+
         w_assert0(remaining <= sizeof(logrec_t));
         memcpy(truncBuf, src + pos, remaining);
         truncCopied = remaining;
@@ -28,6 +28,14 @@
  * invoking nextLogrec() once again, the caller then receives the complete log
  * record.
  *
+ * In contiguous mode, the caller guarantees that the next block follows the
+ * current one in memory (e.g., with a mirrored AsyncRingBuffer). Log records
+ * that do not fit in the current block are then not copied: nextLogrec()
+ * returns false leaving the offset unchanged, and once the caller makes the
+ * next block available (see setReadable), it returns a pointer to the log
+ * record in place. The offset may then go beyond the block size, in which
+ * case it continues on the next block at offset minus block size.
+ *
  * \author Caetano Sauer
  */
 class LogScanner {
@@ -39,11 +47,14 @@ public:
     bool hasPartialLogrec();
     void reset();
 
-    LogScanner(size_t blockSize)
-        : truncCopied(0), toSkip(0), blockSize(blockSize)
+    LogScanner(size_t blockSize, bool contiguous = false)
+        : truncCopied(0), toSkip(0), blockSize(blockSize), contiguous(contiguous),
+        readable(blockSize), truncBuf(nullptr)
     {
-        // maximum logrec size = 3 pages
-        truncBuf = new char[3 * log_storage::BLOCK_SIZE];
+        if (!contiguous) {
+            // maximum logrec size = 3 pages
+            truncBuf = new char[3 * log_storage::BLOCK_SIZE];
+        }
     }
 
     ~LogScanner() {
@@ -54,10 +65,19 @@ public:
         return blockSize;
     }
 
+    bool isContiguous() { return contiguous; }
+
+    // Contiguous mode only: number of bytes that can be read from the start of
+    // the current block
+    void setReadable(size_t bytes) { readable = bytes; }
+    size_t getReadable() { return readable; }
+
 private:
     size_t truncCopied;
     size_t toSkip;
     const size_t blockSize;
+    const bool contiguous;
+    size_t readable;
     char* truncBuf;
 };
 
@@ -4,6 +4,7 @@
 
 #include <boost/regex.hpp>
 #include <cstdio>
+#include <cstdlib>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <atomic>
@@ -20,6 +21,8 @@ using namespace std;
 
 const string log_storage::log_prefix = "log.";
 const string log_storage::log_regex = "log\\.[1-9][0-9]*";
+const string log_storage::prealloc_prefix = "prealloc.log.";
+const string log_storage::recycled_prefix = "recycled.log.";
 
 class partition_recycler_t : public worker_thread_t
 {
@@ -31,6 +34,7 @@ public:
     void do_work()
     {
 	storage->delete_old_partitions();
+	storage->preallocate_partitions();
     }
 
     log_storage* storage;
@@ -42,17 +46,20 @@ public:
  * found in the last block of the last partition -- this logic was moved
  * from the various prime methods of the old LogManager.
  */
-log_storage::log_storage(const std::string& logdir, bool reformat, bool delete_old_partitions, size_t partition_size)
-    : _curr_partition(nullptr)
+log_storage::log_storage(const std::string& logdir, bool reformat, bool delete_old_partitions, size_t partition_size, bool direct_io,
+        std::shared_ptr<StorageBackend> backend)
+    : _backend(backend), _curr_partition(nullptr), _bounce_buf(nullptr)
 {
     if (logdir.empty()) {
         throw std::runtime_error("ERROR: sm_logdir must be set to enable logging");
     }
     _logpath = logdir;
 
-    if (!fs::exists(_logpath)) {
+    if (!_backend) { _backend = StorageBackend::create(); }
+
+    if (!_backend->exists(_logpath.string())) {
         if (reformat) {
-            fs::create_directories(_logpath);
+            _backend->create_directories(_logpath.string());
         } else {
             throw std::runtime_error("Error: could not open the log directory");
         }
@@ -68,23 +75,66 @@ log_storage::log_storage(const std::string& logdir, bool reformat, bool delete_o
 
     _delete_old_partitions = delete_old_partitions;
 
+    // _prealloc_count = options.get_int_option("sm_log_prealloc_partitions", 1);
+    _prealloc_count = 1;
+    // _prezero_partitions = options.get_bool_option("sm_log_prezero_partitions", false);
+    _prezero_partitions = false;
+    // _max_recycled_files = options.get_int_option("sm_log_recycled_partitions", 2);
+    _max_recycled_files = 2;
+    // _max_open_partitions = options.get_int_option("sm_log_max_open_partitions", 64);
+    _max_open_partitions = 64;
+    _access_clock = 0;
+    // _io_unit = options.get_int_option("sm_log_io_unit", 4096);
+    _io_unit = 4096;
+    // Must divide the block size (i.e., the alignment of the log buffer)
+    w_assert0(_io_unit >= 512 && _io_unit <= BLOCK_SIZE && (_io_unit & (_io_unit - 1)) == 0);
+    // _tail_policy = options.get_bool_option("sm_log_rewrite_tail", false) ?
+    //     t_rewrite_unit : t_append;
+    _tail_policy = t_append;
+    _direct_io = direct_io;
+    if (_direct_io) {
+        // Unaligned writes are rejected with direct I/O
+        _tail_policy = t_rewrite_unit;
+        // Partial unit plus skip log record may span two units
+        int res = ::posix_memalign(reinterpret_cast<void**>(&_bounce_buf), _io_unit, 2 * _io_unit);
+        if (res != 0) { throw std::bad_alloc(); }
+    }
+    _flush_count = 0;
+    _bytes_logged = 0;
+    _bytes_written = 0;
+    _bytes_rewritten = 0;
+
     partition_number_t  last_partition = 1;
 
-    fs::directory_iterator it(_logpath), eod;
+    std::vector<string> fnames;
+    _backend->list_directory(_logpath.string(), fnames);
     boost::regex log_rx(log_regex, boost::regex::basic);
-    for (; it != eod; it++) {
-        fs::path fpath = it->path();
-        string fname = fpath.filename().string();
+    for (auto& fname : fnames) {
+        fs::path fpath = _logpath / fname;
+
+        if (fname.compare(0, prealloc_prefix.length(), prealloc_prefix) == 0) {
+            // Left over from a previous run -- never contains log records
+            _backend->remove(fpath.string());
+            continue;
+        }
+
+        if (fname.compare(0, recycled_prefix.length(), recycled_prefix) == 0) {
+            if (reformat || _recycled_files.size() >= _max_recycled_files) {
+                _backend->remove(fpath.string());
+            }
+            else { _recycled_files.push_back(fpath); }
+            continue;
+        }
 
         if (boost::regex_match(fname, log_rx)) {
             if (reformat) {
-                fs::remove(fpath);
+                _backend->remove(fpath.string());
                 continue;
             }
 
             long pnum = std::stoi(fname.substr(log_prefix.length()));
+            // Opened on first access
             _partitions[pnum] = make_shared<partition_t>(this, pnum);
-            _partitions[pnum]->open();
 
             if (pnum >= last_partition) {
                 last_partition = pnum;
@@ -107,6 +157,14 @@ log_storage::~log_storage()
     if (_recycler_thread) {
         _recycler_thread->stop();
     }
+
+    // Partitions may call recycle_file when closed, so they must go before
+    // the members used there
+    _prealloc_partitions.clear();
+    _curr_partition.reset();
+    _partitions.clear();
+
+    free(_bounce_buf);
 }
 
 shared_ptr<partition_t> log_storage::get_partition_for_flush(lsn_t start_lsn,
@@ -132,10 +190,49 @@ shared_ptr<partition_t> log_storage::get_partition_for_flush(lsn_t start_lsn,
 
 shared_ptr<partition_t> log_storage::get_partition(partition_number_t n) const
 {
-    spinlock_read_critical_section cs(&_partition_map_latch);
-    partition_map_t::const_iterator it = _partitions.find(n);
-    if (it == _partitions.end()) { return nullptr; }
-    return it->second;
+    shared_ptr<partition_t> p;
+    {
+        spinlock_read_critical_section cs(&_partition_map_latch);
+        partition_map_t::const_iterator it = _partitions.find(n);
+        if (it == _partitions.end()) { return nullptr; }
+        p = it->second;
+    }
+
+    p->touch(++_access_clock);
+    if (!p->is_open()) {
+        p->open();
+        close_unused_partitions();
+    }
+    return p;
+}
+
+void log_storage::close_unused_partitions() const
+{
+    // Under the write latch, a use count of one means that the partition is
+    // only referenced by the map, and no other thread can get hold of it
+    spinlock_write_critical_section cs(&_partition_map_latch);
+
+    std::vector<shared_ptr<partition_t>> candidates;
+    size_t open = 0;
+    for (auto& e : _partitions) {
+        auto& p = e.second;
+        if (!p->is_open()) { continue; }
+        open++;
+        if (p.use_count() == 1 && p != _curr_partition) {
+            candidates.push_back(p);
+        }
+    }
+    if (open <= _max_open_partitions) { return; }
+
+    std::sort(candidates.begin(), candidates.end(),
+            [] (const shared_ptr<partition_t>& a, const shared_ptr<partition_t>& b) {
+                return a->last_access() < b->last_access();
+            });
+    for (auto& p : candidates) {
+        if (open <= _max_open_partitions) { break; }
+        p->close();
+        open--;
+    }
 }
 
 shared_ptr<partition_t> log_storage::create_partition(partition_number_t pnum)
@@ -147,8 +244,22 @@ shared_ptr<partition_t> log_storage::create_partition(partition_number_t pnum)
         throw std::runtime_error(ss.str());
     }
 
-    p = make_shared<partition_t>(this, pnum);
-    p->open();
+    {
+        lock_guard<mutex> lck(_prealloc_mutex);
+        auto it = _prealloc_partitions.find(pnum);
+        if (it != _prealloc_partitions.end()) {
+            p = it->second;
+            _prealloc_partitions.erase(it);
+        }
+    }
+
+    if (p) {
+        p->activate();
+    }
+    else {
+        p = make_shared<partition_t>(this, pnum);
+        p->open();
+    }
 
     w_assert3(_partitions.find(pnum) == _partitions.end());
 
@@ -178,28 +289,113 @@ unsigned log_storage::delete_old_partitions(partition_number_t older_than)
     // if (!smlevel_0::log || !smlevel_0::bf) { return 0; }
 
     if (older_than == 0) {
-        // CS TODO: this must be abstracted in finelog, since there is no bf!
-        // older_than = smlevel_0::bf->get_archived_run();
-       return 0;
+        // Truncate up to the last partition that was completely archived
+        lock_guard<mutex> lck(_archived_partition_mutex);
+        if (!_archived_partition_fn) { return 0; }
+        older_than = _archived_partition_fn() + 1;
     }
 
-    unsigned count = 0;
+    // Files are only recycled or deleted once the last reference to the
+    // partition is gone, which may happen outside the latch
+    std::vector<shared_ptr<partition_t>> removed;
     {
         spinlock_write_critical_section cs(&_partition_map_latch);
 
         partition_map_t::iterator it = _partitions.begin();
         while (it != _partitions.end()) {
-            if (it->first < older_than) {
-                if (_delete_old_partitions) { it->second->mark_for_deletion(); }
+            // Current partition is never truncated
+            if (it->first < older_than && it->second != _curr_partition) {
+                if (_delete_old_partitions) { it->second->mark_for_recycling(); }
+                removed.push_back(it->second);
                 it = _partitions.erase(it);
-                count++;
             }
             else { it++; }
         }
 
     }
 
-    return count;
+    return removed.size();
+}
+
+void log_storage::set_archived_partition_callback(archived_partition_fn_t fn)
+{
+    lock_guard<mutex> lck(_archived_partition_mutex);
+    _archived_partition_fn = fn;
+}
+
+void log_storage::recycle_file(const fs::path& file, partition_number_t pnum)
+{
+    lock_guard<mutex> lck(_recycle_mutex);
+    if (_recycled_files.size() >= _max_recycled_files) {
+        _backend->remove(file.string());
+        return;
+    }
+
+    auto dest = _logpath / fs::path(recycled_prefix + to_string(pnum));
+    _backend->rename(file.string(), dest.string());
+    _recycled_files.push_back(dest);
+}
+
+void log_storage::count_flush(uint64_t logged, uint64_t written, uint64_t rewritten)
+{
+    _flush_count.fetch_add(1, std::memory_order_relaxed);
+    _bytes_logged.fetch_add(logged, std::memory_order_relaxed);
+    _bytes_written.fetch_add(written, std::memory_order_relaxed);
+    _bytes_rewritten.fetch_add(rewritten, std::memory_order_relaxed);
+}
+
+log_storage::write_stats_t log_storage::get_write_stats() const
+{
+    write_stats_t stats;
+    stats.flushes = _flush_count.load(std::memory_order_relaxed);
+    stats.bytes_logged = _bytes_logged.load(std::memory_order_relaxed);
+    stats.bytes_written = _bytes_written.load(std::memory_order_relaxed);
+    stats.bytes_rewritten = _bytes_rewritten.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void log_storage::preallocate_partitions()
+{
+    auto curr = curr_partition();
+    partition_number_t first = (curr ? curr->num() : 0) + 1;
+
+    for (auto pnum = first; pnum < first + _prealloc_count; pnum++) {
+        {
+            lock_guard<mutex> lck(_prealloc_mutex);
+            if (_prealloc_partitions.count(pnum) > 0) { continue; }
+        }
+
+        // Expensive part happens outside the mutex, so the flush daemon
+        // creates the partition itself if it reaches it in the meantime
+        fs::path recycled;
+        {
+            lock_guard<mutex> lck(_recycle_mutex);
+            if (!_recycled_files.empty()) {
+                recycled = _recycled_files.front();
+                _recycled_files.pop_front();
+            }
+        }
+
+        auto p = make_shared<partition_t>(this, pnum);
+        p->preallocate(_prezero_partitions, recycled.string());
+
+        lock_guard<mutex> lck(_prealloc_mutex);
+        _prealloc_partitions[pnum] = p;
+    }
+
+    // Discard staged partitions that were not used (outside the mutex, since
+    // they are closed when the last reference goes away)
+    std::vector<shared_ptr<partition_t>> unused;
+    curr = curr_partition();
+    {
+        lock_guard<mutex> lck(_prealloc_mutex);
+        auto it = _prealloc_partitions.begin();
+        while (it != _prealloc_partitions.end() && curr && it->first <= curr->num()) {
+            it->second->mark_for_deletion();
+            unused.push_back(it->second);
+            it = _prealloc_partitions.erase(it);
+        }
+    }
 }
 
 shared_ptr<partition_t> log_storage::curr_partition() const
@@ -226,6 +422,11 @@ string log_storage::make_log_name(partition_number_t pnum) const
     return make_log_path(pnum).string();
 }
 
+string log_storage::make_prealloc_name(partition_number_t pnum) const
+{
+    return (_logpath / fs::path(prealloc_prefix + to_string(pnum))).string();
+}
+
 fs::path log_storage::make_log_path(partition_number_t pnum) const
 {
     return _logpath / fs::path(log_prefix + to_string(pnum));
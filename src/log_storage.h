@@ -59,11 +59,15 @@ Rome Research Laboratory Contract No. F30602-97-2-0247.
 
 #include "partition.h"
 #include "latches.h" // for mcs_rwlock
+#include "storage_backend.h"
 #include <map>
 #include <vector>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <deque>
 
 typedef std::map<partition_number_t, std::shared_ptr<partition_t>> partition_map_t;
 
@@ -80,13 +84,17 @@ class log_storage {
     friend class partition_recycler_t;
 
 public:
-    log_storage(const std::string& logdir, bool reformat = false, bool delete_old_partitions = true, size_t partition_size = 1024);
+    // Backend defaults to PosixBackend
+    log_storage(const std::string& logdir, bool reformat = false, bool delete_old_partitions = true, size_t partition_size = 1024, bool direct_io = false,
+            std::shared_ptr<StorageBackend> backend = nullptr);
     virtual ~log_storage();
 
     std::shared_ptr<partition_t>    get_partition_for_flush(lsn_t start_lsn,
                             long start1, long end1, long start2, long end2);
     std::shared_ptr<partition_t>    curr_partition() const;
 
+    // Partition is opened if necessary and stays open while the caller
+    // holds a reference to it (see close_unused_partitions)
     std::shared_ptr<partition_t>       get_partition(partition_number_t n) const;
 
     void list_partitions(std::vector<partition_number_t>& vec) const;
@@ -99,26 +107,125 @@ public:
 
     std::string make_log_name(partition_number_t pnum) const;
     fs::path make_log_path(partition_number_t pnum) const;
+    // Staging name of a preallocated partition (see partition_t::preallocate)
+    std::string make_prealloc_name(partition_number_t pnum) const;
 
     void wakeup_recycler();
     unsigned delete_old_partitions(partition_number_t older_than = 0);
+    void preallocate_partitions();
+
+    /*
+     * Callback that returns the highest partition number whose log records
+     * are all archived (or 0 if none). If set, the recycler thread truncates
+     * the log up to that partition automatically.
+     */
+    using archived_partition_fn_t = std::function<partition_number_t()>;
+    void set_archived_partition_callback(archived_partition_fn_t fn);
+
+    // Adds the (closed) file of the given partition to the pool of files
+    // reused by preallocate_partitions
+    void recycle_file(const fs::path& file, partition_number_t pnum);
+
+    /*
+     * How a flush that starts in the middle of an I/O unit is written (see
+     * partition_t::flush). Rewriting the unit from its beginning keeps
+     * writes aligned, as required by direct I/O, at the cost of writing
+     * the bytes already on disk again on every small flush. Appending only
+     * writes the new bytes and leaves it to the OS to merge them into the
+     * cached page.
+     */
+    enum tail_policy_t { t_rewrite_unit, t_append };
+
+    size_t get_io_unit() const { return _io_unit; }
+    tail_policy_t get_tail_policy() const { return _tail_policy; }
+
+    /*
+     * With direct I/O, partition files bypass the OS page cache and flushes
+     * are durable once the write returns (O_DIRECT and RWF_DSYNC), so no
+     * separate fsync is issued. Writes must then cover whole I/O units, so
+     * the tail policy is always t_rewrite_unit.
+     */
+    bool get_direct_io() const { return _direct_io; }
+
+    // All files of the log, and of an archive built from it, are accessed
+    // through this backend (see StorageBackend)
+    const std::shared_ptr<StorageBackend>& get_backend() const { return _backend; }
+
+    // Bytes handed to the OS by flushes, compared to the bytes of log
+    // records they made durable
+    struct write_stats_t {
+        uint64_t flushes;
+        uint64_t bytes_logged;
+        uint64_t bytes_written;
+        // Part of bytes_written that was already written by earlier flushes
+        uint64_t bytes_rewritten;
+
+        double amplification() const
+        {
+            return bytes_logged > 0 ? double(bytes_written) / bytes_logged : 0.0;
+        }
+    };
+    write_stats_t get_write_stats() const;
 
 private:
 
     fs::path _logpath;
     off_t _partition_size;
 
+    std::shared_ptr<StorageBackend> _backend;
+
     partition_map_t _partitions;
     std::shared_ptr<partition_t> _curr_partition;
 
     bool _delete_old_partitions;
 
+    // Partitions following the current one which are kept preallocated by
+    // the recycler thread, so that rollover doesn't create files
+    partition_map_t _prealloc_partitions;
+    std::mutex _prealloc_mutex;
+    unsigned _prealloc_count;
+    bool _prezero_partitions;
+
+    // Files of truncated partitions which are reused for new ones instead
+    // of being deleted, so that their blocks are already allocated
+    std::deque<fs::path> _recycled_files;
+    std::mutex _recycle_mutex;
+    size_t _max_recycled_files;
+
+    archived_partition_fn_t _archived_partition_fn;
+    std::mutex _archived_partition_mutex;
+
+    size_t _io_unit;
+    tail_policy_t _tail_policy;
+    bool _direct_io;
+
+    // Aligned copy of the last (partial) I/O unit of a direct-I/O flush,
+    // followed by the skip log record and zeroes (see partition_t::flush)
+    char* _bounce_buf;
+
+    // Write statistics, only updated by the flush daemon
+    std::atomic<uint64_t> _flush_count;
+    std::atomic<uint64_t> _bytes_logged;
+    std::atomic<uint64_t> _bytes_written;
+    std::atomic<uint64_t> _bytes_rewritten;
+    void count_flush(uint64_t logged, uint64_t written, uint64_t rewritten);
+
     // forbid copy
     log_storage(const log_storage&);
     log_storage& operator=(const log_storage&);
 
     void try_delete(partition_number_t);
 
+    /*
+     * Partitions are only opened (and mapped) on first access, and at most
+     * _max_open_partitions are kept open. Beyond that, the least recently
+     * used partitions that are not referenced outside the partition map
+     * are closed.
+     */
+    void close_unused_partitions() const;
+    size_t _max_open_partitions;
+    mutable std::atomic<uint64_t> _access_clock;
+
     // Latch to protect access to partition map
     mutable mcs_rwlock _partition_map_latch;
 
@@ -128,6 +235,8 @@ public:
     enum { BLOCK_SIZE = partition_t::XFERSIZE };
     static const std::string log_prefix;
     static const std::string log_regex;
+    static const std::string prealloc_prefix;
+    static const std::string recycled_prefix;
 };
 
 #endif
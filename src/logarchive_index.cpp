@@ -6,6 +6,9 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sstream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
 
 #include "lsn.h"
 #include "latches.h"
@@ -35,16 +38,43 @@ public:
 // definition of static members
 const string ArchiveIndex::RUN_PREFIX = "archive_";
 const string ArchiveIndex::CURR_RUN_PREFIX = "current_run_";
+// Runs of whole log partitions are named archive_L_P-Q; other runs carry the
+// sub-partition numbers as archive_L_P.S-Q.T
 const string ArchiveIndex::run_regex =
-    "^archive_([1-9][0-9]*)_([1-9][0-9]*)-([1-9][0-9]*)$";
+    "^archive_([1-9][0-9]*)_([0-9]+)(\\.([0-9]+))?-([1-9][0-9]*)(\\.([0-9]+))?$";
 const string ArchiveIndex::current_regex = "^current_run_[1-9][0-9]*$";
+const string ArchiveIndex::CKPT_SUFFIX = ".ckpt";
+const string ArchiveIndex::checkpoint_regex = "^current_run_[1-9][0-9]*\\.ckpt(\\.tmp)?$";
+const string ArchiveIndex::SPILL_PREFIX = "spill_run_";
+const string ArchiveIndex::spill_regex = "^spill_run_[0-9]+_[0-9]+$";
+const string ArchiveIndex::MANIFEST_NAME = "archive_manifest";
 
 struct RunFooter {
     uint64_t index_begin;
     uint64_t index_size;
     PageID maxPID;
+    // Identifies footers whose index entries carry page-image markers.
+    // Older footers have unspecified padding in this position.
+    uint32_t format;
 };
 
+constexpr uint32_t RunFormatImgMarkers = 0x494d4731; // "IMG1"
+// Same as above, plus the end LSN of the run stored between the index
+// entries and the footer
+constexpr uint32_t RunFormatEndLSN = 0x4c534e31; // "LSN1"
+
+static_assert(sizeof(ArchiveIndex::BlockEntry) == 16, "BlockEntry layout changed");
+static_assert(sizeof(RunFooter) == 24, "RunFooter layout changed");
+
+constexpr uint32_t ManifestMagic = 0x4d414e31; // "MAN1"
+static_assert(sizeof(ArchiveIndex::ManifestEntry) == 64, "ManifestEntry layout changed");
+
+constexpr uint32_t CheckpointMagic = 0x434b5031; // "CKP1"
+static_assert(sizeof(ArchiveIndex::RunCheckpoint) == 64, "RunCheckpoint layout changed");
+
+// MAX_LOAD_THREADS = options.get_int_option("sm_archiver_load_threads", 8);
+const static unsigned MAX_LOAD_THREADS = 8;
+
 bool ArchiveIndex::parseRunFileName(string fname, RunId& fstats)
 {
     boost::regex run_rx(run_regex, boost::regex::perl);
@@ -53,22 +83,21 @@ bool ArchiveIndex::parseRunFileName(string fname, RunId& fstats)
 
     fstats.level = std::stoi(res[1]);
 
-    std::stringstream is;
-    is.str(res[2]);
-    is >> fstats.begin;
-    is.clear();
-    is.str(res[3]);
-    is >> fstats.end;
+    uint32_t beginSub = res[4].matched ? std::stoul(res[4]) : 0;
+    uint32_t endSub = res[7].matched ? std::stoul(res[7]) : RunSubMax;
+    if (beginSub > RunSubMax || endSub > RunSubMax) { return false; }
+
+    fstats.begin = make_run_number(std::stoul(res[2]), beginSub);
+    fstats.end = make_run_number(std::stoul(res[5]), endSub);
 
     return true;
 }
 
 size_t ArchiveIndex::getFileSize(int fd)
 {
-    struct stat stat;
-    auto ret = ::fstat(fd, &stat);
-    CHECK_ERRNO(ret);
-    return stat.st_size;
+    auto size = backend->file_size(fd);
+    CHECK_ERRNO(size);
+    return size;
 }
 
 ArchiveIndex::ArchiveIndex(const string& archdir, log_storage* logStorage, bool reformat, size_t max_open_files)
@@ -81,56 +110,59 @@ ArchiveIndex::ArchiveIndex(const string& archdir, log_storage* logStorage, bool
         throw std::runtime_error("Option for archive directory must be specified");
     }
 
-    if (!fs::exists(archdir)) {
+    // Archive files are kept in the same kind of storage as the log
+    backend = logStorage ? logStorage->get_backend() : StorageBackend::create();
+
+    if (!backend->exists(archdir)) {
         if (reformat) {
-            fs::create_directories(archdir);
+            backend->create_directories(archdir);
         } else {
             throw std::runtime_error("Error: could not open the log archive directory");
         }
     }
 
     maxLevel = 0;
+    manifestFd = -1;
+    hasResumableRun = false;
     archpath = archdir;
-    fs::directory_iterator it(archpath), eod;
-    boost::regex current_rx(current_regex, boost::regex::perl);
-
-    // create/load index
-    unsigned runsFound = 0;
-    for (; it != eod; it++) {
-        fs::path fpath = it->path();
-        string fname = fpath.filename().string();
-        RunId fstats;
-
-        if (parseRunFileName(fname, fstats)) {
-            if (reformat) {
-                fs::remove(fpath);
-                continue;
-            }
-
-            auto runFile = openForScan(fstats);
-            loadRunInfo(runFile, fstats);
-            closeScan(fstats);
 
-            if (fstats.level > maxLevel) { maxLevel = fstats.level; }
+    // Runs are taken from the manifest; the directory is only listed if the
+    // manifest is missing, torn, or does not match the run files
+    std::unordered_map<RunId, ManifestEntry> manifest;
+    std::vector<RunId> found;
+    std::vector<RunInfo> loaded;
+    std::vector<ManifestEntry> entries;
+    bool foundUnfinished = false;
+    bool consistent = false;
+    if (!reformat && readManifest(manifest)) {
+        for (auto& e : manifest) { found.push_back(e.first); }
+        consistent = loadRuns(found, manifest, loaded, entries);
+        if (consistent) { foundUnfinished = removeLeftovers(found); }
+    }
+    if (!consistent) {
+        DBGTHRD(<< "Archive manifest missing or out of date -- listing directory");
+        found.clear();
+        foundUnfinished = listDirectory(reformat, found);
+        loadRuns(found, manifest, loaded, entries);
+        rewriteManifest(entries);
+    }
 
-            runsFound++;
-        }
-        else if (boost::regex_match(fname, current_rx)) {
-            DBGTHRD(<< "Found unfinished log archive run. Deleting");
-            fs::remove(fpath);
-        }
-        else {
-            // CS TODO: this logic is repeated in log_storage
-            std::stringstream ss;
-            ss << "ArchiveIndex: cannot parse filename " << fname;
-            throw std::runtime_error(ss.str());
-        }
+    for (size_t i = 0; i < found.size(); i++) {
+        addRunInfo(std::move(loaded[i]), found[i].level);
     }
+    unsigned runsFound = found.size();
 
     for (unsigned l = 0; l < runs.size(); l++) {
         std::sort(runs[l].begin(), runs[l].end());
     }
 
+    auto mpath = (archpath / MANIFEST_NAME).string();
+    manifestFd = backend->open(mpath, O_WRONLY | O_CREAT | O_APPEND, 0744 /*mode*/);
+    CHECK_ERRNO(manifestFd);
+
+    if (foundUnfinished) { recoverUnfinishedRun(); }
+    else { backend->remove(make_checkpoint_path(1).string()); }
+
     // no runs found in archive log -- start from first available log file
     if (runsFound == 0) {
         std::vector<partition_number_t> partitions;
@@ -141,11 +173,13 @@ ArchiveIndex::ArchiveIndex(const string& archdir, log_storage* logStorage, bool
         if (partitions.size() > 0) {
             auto nextPartition = partitions[0];
             if (nextPartition > 1) {
+                // Gap run takes the place of the unfinished one
+                discardRunCheckpoint();
                 // create empty run to fill in the missing gap
                 openNewRun(1);
-                run_number_t lastRun = nextPartition - 1;
+                run_number_t lastRun = make_run_number(nextPartition - 1, RunSubMax);
                 closeCurrentRun(lastRun, 1);
-                RunId fstats = {1, lastRun, 1};
+                RunId fstats = {make_run_number(1, 0), lastRun, 1};
                 auto runFile = openForScan(fstats);
                 loadRunInfo(runFile, fstats);
                 closeScan(fstats);
@@ -153,6 +187,8 @@ ArchiveIndex::ArchiveIndex(const string& archdir, log_storage* logStorage, bool
         }
     }
 
+    _closedRuns.publish(getLastRun());
+
     // if (replFactor > 0) {
         // CS TODO -- not implemented, see comments on deleteRuns
         // runRecycler.reset(new RunRecycler {replFactor, this});
@@ -163,6 +199,451 @@ ArchiveIndex::ArchiveIndex(const string& archdir, log_storage* logStorage, bool
 ArchiveIndex::~ArchiveIndex()
 {
     if (runRecycler) { runRecycler->stop(); }
+    if (manifestFd >= 0) { backend->close(manifestFd); }
+}
+
+bool ArchiveIndex::listDirectory(bool reformat, std::vector<RunId>& found)
+{
+    std::vector<string> fnames;
+    backend->list_directory(archpath.string(), fnames);
+    boost::regex current_rx(current_regex, boost::regex::perl);
+    boost::regex spill_rx(spill_regex, boost::regex::perl);
+    boost::regex ckpt_rx(checkpoint_regex, boost::regex::perl);
+    // Only the run generated by the archiver (level 1) may be resumed
+    auto resumable = make_current_run_path(1).filename().string();
+
+    // Only file names are listed here; run indexes are loaded by loadRuns
+    bool foundUnfinished = false;
+    for (auto& fname : fnames) {
+        fs::path fpath = archpath / fname;
+        RunId fstats;
+
+        if (parseRunFileName(fname, fstats)) {
+            if (reformat) {
+                backend->remove(fpath.string());
+                continue;
+            }
+            found.push_back(fstats);
+        }
+        else if (fname == MANIFEST_NAME) {
+            if (reformat) { backend->remove(fpath.string()); }
+        }
+        else if (boost::regex_match(fname, current_rx)) {
+            if (fname == resumable && !reformat) {
+                foundUnfinished = true;
+                continue;
+            }
+            DBGTHRD(<< "Found unfinished log archive run. Deleting");
+            backend->remove(fpath.string());
+        }
+        else if (boost::regex_match(fname, ckpt_rx)) {
+            // Checkpoint of the level-1 run is read by recoverUnfinishedRun
+            if (fname != resumable + CKPT_SUFFIX || reformat) { backend->remove(fpath.string()); }
+        }
+        else if (boost::regex_match(fname, spill_rx)) {
+            DBGTHRD(<< "Found leftover archiver spill file. Deleting");
+            backend->remove(fpath.string());
+        }
+        else {
+            // CS TODO: this logic is repeated in log_storage
+            std::stringstream ss;
+            ss << "ArchiveIndex: cannot parse filename " << fname;
+            throw std::runtime_error(ss.str());
+        }
+    }
+    return foundUnfinished;
+}
+
+/*
+ * Files other than runs are only left behind by a crash, and they are all at
+ * known paths: unfinished runs of the archiver (level 1) and of merges (up to
+ * one level above the highest run), and their checkpoints. Spill files are
+ * removed as soon as they are mapped (see ArchiverSpill::spill). Returns
+ * whether the unfinished run of level 1 exists, which may be resumed.
+ */
+bool ArchiveIndex::removeLeftovers(const std::vector<RunId>& found)
+{
+    unsigned highest = 1;
+    for (auto& r : found) { highest = std::max(highest, r.level); }
+
+    for (unsigned l = 1; l <= highest + 1; l++) {
+        auto cpath = make_checkpoint_path(l).string();
+        backend->remove(cpath + ".tmp");
+        if (l == 1) { continue; }
+        auto rpath = make_current_run_path(l);
+        if (backend->exists(rpath.string())) {
+            DBGTHRD(<< "Found unfinished log archive run. Deleting");
+            backend->remove(rpath.string());
+        }
+        backend->remove(cpath);
+    }
+    return backend->exists(make_current_run_path(1).string());
+}
+
+bool ArchiveIndex::loadRuns(const std::vector<RunId>& found,
+        const std::unordered_map<RunId, ManifestEntry>& manifest,
+        std::vector<RunInfo>& loaded, std::vector<ManifestEntry>& entries)
+{
+    loaded.clear();
+    loaded.resize(found.size());
+    entries.clear();
+    entries.resize(found.size());
+    std::atomic<bool> consistent{manifest.size() == found.size()};
+
+    // Run files are independent of each other, so they are read in parallel
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    auto worker = [&] {
+        try {
+            size_t i;
+            while ((i = next++) < found.size()) {
+                auto e = manifest.find(found[i]);
+                auto known = e != manifest.end() ? &e->second : nullptr;
+                if (!readRunInfo(found[i], known, loaded[i], entries[i])) {
+                    consistent = false;
+                }
+            }
+        }
+        catch (...) {
+            std::unique_lock<std::mutex> lck{errorMutex};
+            error = std::current_exception();
+        }
+    };
+
+    unsigned threadCount = std::min<size_t>(found.size(),
+            std::min(MAX_LOAD_THREADS, std::max(1u, std::thread::hardware_concurrency())));
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < threadCount; i++) { threads.emplace_back(worker); }
+    worker();
+    for (auto& t : threads) { t.join(); }
+    if (error) { std::rethrow_exception(error); }
+
+    return consistent;
+}
+
+/*
+ * Reads the index of the given run from its file. If the manifest entry is
+ * given and matches the file size, the index is read right away from the
+ * offsets recorded there; otherwise, they are taken from the run footer.
+ * Returns whether the manifest entry was used. A run file listed in the
+ * manifest may be missing (e.g., if runs were deleted), in which case false
+ * is returned and nothing is read.
+ */
+bool ArchiveIndex::readRunInfo(const RunId& runid, const ManifestEntry* known,
+        RunInfo& run, ManifestEntry& entry)
+{
+    auto fpath = make_run_path(runid.begin, runid.end, runid.level).string();
+    int fd = backend->open(fpath, O_RDONLY);
+    if (fd < 0 && errno == ENOENT && known) { return false; }
+    CHECK_ERRNO(fd);
+    size_t length = getFileSize(fd);
+
+    bool useManifest = known && known->fileSize == length;
+    if (useManifest) {
+        entry = *known;
+    }
+    else {
+        memset(&entry, 0, sizeof(ManifestEntry));
+        entry.magic = ManifestMagic;
+        entry.level = runid.level;
+        entry.begin = runid.begin;
+        entry.end = runid.end;
+        entry.fileSize = length;
+        if (length > 0) {
+            // Read footer from end of file
+            w_assert0(length > sizeof(RunFooter));
+            RunFooter footer;
+            auto ret = backend->pread(fd, &footer, sizeof(RunFooter), length - sizeof(RunFooter));
+            CHECK_ERRNO(ret);
+            w_assert0(length > footer.index_begin);
+            w_assert0(length > sizeof(RunFooter) + footer.index_size);
+            entry.indexBegin = footer.index_begin;
+            entry.indexSize = footer.index_size;
+            entry.maxPID = footer.maxPID;
+            entry.format = footer.format;
+            entry.endLSN = lsn_t::null.data();
+            if (footer.format == RunFormatEndLSN) {
+                ret = backend->pread(fd, &entry.endLSN, sizeof(lsndata_t),
+                        footer.index_begin + footer.index_size);
+                CHECK_ERRNO(ret);
+            }
+        }
+    }
+
+    run.begin = runid.begin;
+    run.end = runid.end;
+    if (length > 0) {
+        run.maxPID = entry.maxPID;
+        run.hasImgMarkers = entry.format == RunFormatImgMarkers
+            || entry.format == RunFormatEndLSN;
+        if (entry.format == RunFormatEndLSN) { run.endLSN = lsn_t(entry.endLSN); }
+
+        w_assert0(entry.indexSize % sizeof(BlockEntry) == 0);
+        run.entries.resize(entry.indexSize / sizeof(BlockEntry));
+        if (entry.indexSize > 0) {
+            auto ret = backend->pread(fd, &run.entries[0], entry.indexSize, entry.indexBegin);
+            CHECK_ERRNO(ret);
+            w_assert0((size_t) ret == entry.indexSize);
+        }
+    }
+
+    auto ret = backend->close(fd);
+    CHECK_ERRNO(ret);
+    return useManifest;
+}
+
+/*
+ * Returns false if the manifest is missing or torn, i.e., if a crash
+ * interrupted an append. Entries appended after a torn one could not be read
+ * back, so the manifest is then rewritten from a directory listing.
+ */
+bool ArchiveIndex::readManifest(std::unordered_map<RunId, ManifestEntry>& manifest)
+{
+    auto mpath = (archpath / MANIFEST_NAME).string();
+    int fd = backend->open(mpath, O_RDONLY);
+    if (fd < 0 && errno == ENOENT) { return false; }
+    CHECK_ERRNO(fd);
+
+    size_t fsize = getFileSize(fd);
+    std::vector<ManifestEntry> entries(fsize / sizeof(ManifestEntry));
+    if (entries.size() > 0) {
+        auto ret = backend->pread(fd, &entries[0], entries.size() * sizeof(ManifestEntry), 0);
+        CHECK_ERRNO(ret);
+    }
+    auto ret = backend->close(fd);
+    CHECK_ERRNO(ret);
+
+    if (fsize % sizeof(ManifestEntry) != 0) { return false; }
+    for (auto& e : entries) {
+        if (e.magic != ManifestMagic) { return false; }
+        manifest[RunId{e.begin, e.end, e.level}] = e;
+    }
+    return true;
+}
+
+void ArchiveIndex::rewriteManifest(const std::vector<ManifestEntry>& entries)
+{
+    auto mpath = archpath / MANIFEST_NAME;
+    auto tmppath = archpath / (MANIFEST_NAME + ".tmp");
+    int fd = backend->open(tmppath.string(), O_WRONLY | O_CREAT | O_TRUNC, 0744 /*mode*/);
+    CHECK_ERRNO(fd);
+    if (entries.size() > 0) {
+        auto ret = backend->pwrite(fd, &entries[0], entries.size() * sizeof(ManifestEntry), 0);
+        CHECK_ERRNO(ret);
+    }
+    auto ret = backend->fsync(fd);
+    CHECK_ERRNO(ret);
+    ret = backend->close(fd);
+    CHECK_ERRNO(ret);
+    backend->rename(tmppath.string(), mpath.string());
+}
+
+/*
+ * Called once a run file is complete and synced, but before it is renamed,
+ * so that every run file is listed in the manifest. The manifest entry is
+ * derived from the footer just written, so that it matches what is found by
+ * readRunInfo. If the rename is lost in a crash, the entry refers to a
+ * missing file, and the manifest is rewritten on the next startup.
+ */
+void ArchiveIndex::appendManifest(const RunId& runid, int fd)
+{
+    ManifestEntry entry;
+    memset(&entry, 0, sizeof(ManifestEntry));
+    entry.magic = ManifestMagic;
+    entry.level = runid.level;
+    entry.begin = runid.begin;
+    entry.end = runid.end;
+    entry.fileSize = getFileSize(fd);
+    entry.endLSN = lsn_t::null.data();
+    if (entry.fileSize > 0) {
+        RunFooter footer;
+        auto ret = backend->pread(fd, &footer, sizeof(RunFooter), entry.fileSize - sizeof(RunFooter));
+        CHECK_ERRNO(ret);
+        entry.indexBegin = footer.index_begin;
+        entry.indexSize = footer.index_size;
+        entry.maxPID = footer.maxPID;
+        entry.format = footer.format;
+        if (footer.format == RunFormatEndLSN) {
+            ret = backend->pread(fd, &entry.endLSN, sizeof(lsndata_t),
+                    footer.index_begin + footer.index_size);
+            CHECK_ERRNO(ret);
+        }
+    }
+
+    std::unique_lock<std::mutex> lck{manifestMutex};
+    auto ret = backend->write(manifestFd, &entry, sizeof(ManifestEntry));
+    CHECK_ERRNO(ret);
+    ret = backend->fsync(manifestFd);
+    CHECK_ERRNO(ret);
+}
+
+/*
+ * The unfinished run file is kept only if its checkpoint is intact and the
+ * run begins right after the last finished one, i.e., no run was closed
+ * after the checkpoint was taken. The file is then truncated to the
+ * checkpointed prefix, since blocks beyond it might not have been synced.
+ * Whether the checkpoint also matches where the log archiver resumes is
+ * up to the archiver (see getRunCheckpoint).
+ */
+void ArchiveIndex::recoverUnfinishedRun()
+{
+    auto cpath = make_checkpoint_path(1).string();
+    auto rpath = make_current_run_path(1).string();
+    bool valid = false;
+
+    int rfd = backend->open(rpath, O_RDWR);
+    CHECK_ERRNO(rfd);
+    size_t runSize = getFileSize(rfd);
+
+    int fd = backend->open(cpath, O_RDONLY);
+    if (fd < 0 && errno != ENOENT) { CHECK_ERRNO(fd); }
+    if (fd >= 0) {
+        RunCheckpoint ckpt;
+        size_t fsize = getFileSize(fd);
+        if (fsize >= sizeof(RunCheckpoint)) {
+            auto ret = backend->pread(fd, &ckpt, sizeof(RunCheckpoint), 0);
+            CHECK_ERRNO(ret);
+            auto lastRun = getLastRun();
+            run_number_t begin = lastRun > 0 ? lastRun + 1 : make_run_number(1, 0);
+            valid = ckpt.magic == CheckpointMagic && ckpt.level == 1
+                && ckpt.begin == begin && ckpt.length > 0
+                && fsize == sizeof(RunCheckpoint) + ckpt.entryCount * sizeof(BlockEntry)
+                && runSize >= ckpt.length;
+        }
+        if (valid) {
+            resumeCkpt = ckpt;
+            resumeEntries.resize(ckpt.entryCount);
+            if (ckpt.entryCount > 0) {
+                auto ret = backend->pread(fd, &resumeEntries[0], ckpt.entryCount * sizeof(BlockEntry),
+                        sizeof(RunCheckpoint));
+                CHECK_ERRNO(ret);
+            }
+        }
+        auto ret = backend->close(fd);
+        CHECK_ERRNO(ret);
+    }
+
+    if (!valid) {
+        DBGTHRD(<< "Found unfinished log archive run. Deleting");
+        auto ret = backend->close(rfd);
+        CHECK_ERRNO(ret);
+        backend->remove(rpath);
+        backend->remove(cpath);
+        return;
+    }
+
+    DBGTHRD(<< "Found unfinished log archive run. Keeping first "
+            << resumeCkpt.length << " bytes");
+    auto ret = backend->ftruncate(rfd, resumeCkpt.length);
+    CHECK_ERRNO(ret);
+    ret = backend->close(rfd);
+    CHECK_ERRNO(ret);
+    hasResumableRun = true;
+}
+
+bool ArchiveIndex::getRunCheckpoint(RunCheckpoint& ckpt)
+{
+    spinlock_read_critical_section cs(&_mutex);
+    if (!hasResumableRun) { return false; }
+    ckpt = resumeCkpt;
+    return true;
+}
+
+void ArchiveIndex::discardRunCheckpoint()
+{
+    {
+        spinlock_write_critical_section cs(&_mutex);
+        if (!hasResumableRun) { return; }
+        hasResumableRun = false;
+        resumeEntries.clear();
+    }
+    DBGTHRD(<< "Discarding unfinished log archive run");
+    backend->remove(make_current_run_path(1).string());
+    backend->remove(make_checkpoint_path(1).string());
+}
+
+bool ArchiveIndex::resumeRun(unsigned level, run_number_t& run, size_t& length)
+{
+    std::string fname = make_current_run_path(level).string();
+    spinlock_write_critical_section cs(&_mutex);
+    if (!hasResumableRun || resumeCkpt.level != level) { return false; }
+
+    auto fd = backend->open(fname, O_RDWR);
+    CHECK_ERRNO(fd);
+    DBGTHRD(<< "Resumed output run in level " << level << " at offset " << resumeCkpt.length);
+
+    appendFd.resize(level+1, -1);
+    appendFd[level] = fd;
+    appendPos.resize(level+1, 0);
+    appendPos[level] = resumeCkpt.length;
+
+    // Entries of the prefix are already in place, as if by newBlock
+    appendNewRun(level);
+    runs[level].back().entries = std::move(resumeEntries);
+
+    run = resumeCkpt.run;
+    length = resumeCkpt.length;
+    hasResumableRun = false;
+    resumeEntries.clear();
+    return true;
+}
+
+/*
+ * Called by the writer threads once all blocks up to the given file offset
+ * are written. The checkpoint is written to a temporary file and renamed,
+ * so that a crash leaves either the old or the new one behind.
+ */
+void ArchiveIndex::checkpointRun(unsigned level, run_number_t run, run_number_t closeAs,
+        lsn_t endLSN, size_t length)
+{
+    auto lastRun = level == 1 ? getLastRun() : getLastRun(level);
+
+    RunCheckpoint ckpt;
+    memset(&ckpt, 0, sizeof(RunCheckpoint));
+    ckpt.magic = CheckpointMagic;
+    ckpt.level = level;
+    ckpt.begin = lastRun > 0 ? lastRun + 1 : make_run_number(1, 0);
+    ckpt.run = run;
+    ckpt.closeAs = closeAs;
+    ckpt.endLSN = endLSN.data();
+
+    std::vector<BlockEntry> entries;
+    {
+        spinlock_read_critical_section cs(&_mutex);
+        size_t lf = lastFinished[level] + 1;
+        w_assert0(lf < runs[level].size());
+        for (auto& e : runs[level][lf].entries) {
+            if (e.offset >= length) { break; }
+            entries.push_back(e);
+        }
+    }
+
+    // Bucket of the last PID is regenerated when resuming
+    if (entries.size() < 2) { return; }
+    ckpt.length = entries.back().offset;
+    ckpt.resumePID = entries.back().pid;
+    entries.pop_back();
+    ckpt.entryCount = entries.size();
+
+    // Prefix must be persistent before the checkpoint refers to it
+    fsync(level);
+
+    auto cpath = make_checkpoint_path(level);
+    auto tmppath = fs::path(cpath.string() + ".tmp");
+    int fd = backend->open(tmppath.string(), O_WRONLY | O_CREAT | O_TRUNC, 0744 /*mode*/);
+    CHECK_ERRNO(fd);
+    auto ret = backend->pwrite(fd, &ckpt, sizeof(RunCheckpoint), 0);
+    CHECK_ERRNO(ret);
+    ret = backend->pwrite(fd, &entries[0], entries.size() * sizeof(BlockEntry), sizeof(RunCheckpoint));
+    CHECK_ERRNO(ret);
+    ret = backend->fsync(fd);
+    CHECK_ERRNO(ret);
+    ret = backend->close(fd);
+    CHECK_ERRNO(ret);
+    backend->rename(tmppath.string(), cpath.string());
+
+    DBGTHRD(<< "Checkpointed run " << run << " up to offset " << ckpt.length);
 }
 
 void ArchiveIndex::listFiles(std::vector<std::string>& list, int level)
@@ -170,9 +651,9 @@ void ArchiveIndex::listFiles(std::vector<std::string>& list, int level)
     list.clear();
 
     // CS TODO unify with listFileStats
-    fs::directory_iterator it(archpath), eod;
-    for (; it != eod; it++) {
-        string fname = it->path().filename().string();
+    std::vector<string> fnames;
+    backend->list_directory(archpath.string(), fnames);
+    for (auto& fname : fnames) {
         RunId fstats;
         if (parseRunFileName(fname, fstats)) {
             if (level < 0 || level == static_cast<int>(fstats.level)) {
@@ -210,9 +691,10 @@ void ArchiveIndex::listFileStats(list<RunId>& list, int level)
  */
 void ArchiveIndex::openNewRun(unsigned level)
 {
-    int flags = O_WRONLY | O_CREAT;
+    // Also read when the run is closed (see appendManifest)
+    int flags = O_RDWR | O_CREAT;
     std::string fname = make_current_run_path(level).string();
-    auto fd = ::open(fname.c_str(), flags, 0744 /*mode*/);
+    auto fd = backend->open(fname, flags, 0744 /*mode*/);
     CHECK_ERRNO(fd);
     DBGTHRD(<< "Opened new output run in level " << level);
 
@@ -230,8 +712,15 @@ void ArchiveIndex::openNewRun(unsigned level)
 fs::path ArchiveIndex::make_run_path(run_number_t begin, run_number_t end, unsigned level)
     const
 {
-    return archpath / fs::path(RUN_PREFIX + std::to_string(level) + "_" + std::to_string(begin)
-            + "-" + std::to_string(end));
+    std::string name = RUN_PREFIX + std::to_string(level) + "_";
+    if (run_sub(begin) == 0 && run_sub(end) == RunSubMax) {
+        name += std::to_string(run_partition(begin)) + "-" + std::to_string(run_partition(end));
+    }
+    else {
+        name += std::to_string(run_partition(begin)) + "." + std::to_string(run_sub(begin))
+            + "-" + std::to_string(run_partition(end)) + "." + std::to_string(run_sub(end));
+    }
+    return archpath / fs::path(name);
 }
 
 fs::path ArchiveIndex::make_current_run_path(unsigned level) const
@@ -239,7 +728,19 @@ fs::path ArchiveIndex::make_current_run_path(unsigned level) const
     return archpath / fs::path(CURR_RUN_PREFIX + std::to_string(level));
 }
 
-void ArchiveIndex::closeCurrentRun(run_number_t currentRun, unsigned level, PageID maxPID)
+fs::path ArchiveIndex::make_checkpoint_path(unsigned level) const
+{
+    return archpath / fs::path(CURR_RUN_PREFIX + std::to_string(level) + CKPT_SUFFIX);
+}
+
+std::string ArchiveIndex::getSpillPath(run_number_t run, unsigned number) const
+{
+    return (archpath / fs::path(SPILL_PREFIX + std::to_string(run) + "_"
+                + std::to_string(number))).string();
+}
+
+void ArchiveIndex::closeCurrentRun(run_number_t currentRun, unsigned level, PageID maxPID,
+        lsn_t endLSN)
 {
     run_number_t lastRun = 0;
     if (level == 1) {
@@ -256,22 +757,35 @@ void ArchiveIndex::closeCurrentRun(run_number_t currentRun, unsigned level, Page
                 spinlock_read_critical_section cs(&_mutex);
                 // register index information and write it on end of file
                 if (appendPos[level] > 0) {
-                    // take into account space for skip log record
-                    appendPos[level] += sizeof(baseLogHeader);
+                    // terminate the run with a skip log record
+                    const logrec_t& eof = logrec_t::get_eof_logrec();
+                    auto ret = backend->pwrite(appendFd[level], &eof, eof.length(), appendPos[level]);
+                    CHECK_ERRNO(ret);
+                    appendPos[level] += eof.length();
                 }
             }
 
-            finishRun(lastRun+1, currentRun, maxPID, appendFd[level], appendPos[level], level);
-            fs::path new_path = make_run_path(lastRun+1, currentRun, level);
-            fs::rename(make_current_run_path(level), new_path);
+            // First run of the archive starts on the first log partition
+            run_number_t begin = lastRun > 0 ? lastRun + 1 : make_run_number(1, 0);
+            finishRun(begin, currentRun, maxPID, appendFd[level], appendPos[level], level,
+                    endLSN);
+            if (manifestFd >= 0) {
+                // Run must be persistent before the manifest refers to it
+                auto ret = backend->fsync(appendFd[level]);
+                CHECK_ERRNO(ret);
+                appendManifest(RunId{begin, currentRun, level}, appendFd[level]);
+            }
+            fs::path new_path = make_run_path(begin, currentRun, level);
+            backend->rename(make_current_run_path(level).string(), new_path.string());
+            // Checkpoint is now obsolete (and would not match the next run)
+            backend->remove(make_checkpoint_path(level).string());
 
             DBGTHRD(<< "Closing current output run: " << new_path.string());
         }
 
-        auto ret = ::fsync(appendFd[level]);
+        auto ret = backend->fsync(appendFd[level]);
         CHECK_ERRNO(ret);
-
-        ret = ::close(appendFd[level]);
+        ret = backend->close(appendFd[level]);
         CHECK_ERRNO(ret);
         appendFd[level] = -1;
 
@@ -289,29 +803,39 @@ void ArchiveIndex::closeCurrentRun(run_number_t currentRun, unsigned level, Page
                 // }
             }
         }
+
+        if (currentRun > 0) { _closedRuns.publish(getLastRun()); }
     }
 
     openNewRun(level);
 }
 
-void ArchiveIndex::append(char* data, size_t length, unsigned level)
+/*
+ * Blocks of the current run may be appended concurrently and out of order,
+ * each one at its own offset. The skip log record that terminates the run is
+ * only written when the run is closed (see closeCurrentRun), at which point
+ * all blocks must have been appended.
+ */
+void ArchiveIndex::append(const char* data, size_t length, off_t offset, unsigned level)
 {
-    // Precondition: there is always space for a skip log record at the end (see BlockAssembly::spaceToReserve)
-    memcpy(data + length, &logrec_t::get_eof_logrec(), logrec_t::get_eof_logrec().length());
-
     // beginning of block must be a valid log record
-    w_assert1(reinterpret_cast<logrec_t*>(data)->valid_header());
+    w_assert1(reinterpret_cast<const logrec_t*>(data)->valid_header());
 
     // INC_TSTAT(la_block_writes);
-    auto ret = ::pwrite(appendFd[level], data, length + logrec_t::get_eof_logrec().length(),
-                appendPos[level]);
+    auto ret = backend->pwrite(appendFd[level], data, length, offset);
     CHECK_ERRNO(ret);
-    appendPos[level] += length;
+    w_assert0((size_t) ret == length);
+
+    spinlock_write_critical_section cs(&_mutex);
+    if (offset + (off_t) length > appendPos[level]) {
+        appendPos[level] = offset + length;
+    }
 }
 
 void ArchiveIndex::fsync(unsigned level)
 {
-    auto ret = ::fsync(appendFd[level]);
+    // Run files are only renamed after a full fsync on closeCurrentRun
+    auto ret = backend->fdatasync(appendFd[level]);
     CHECK_ERRNO(ret);
 }
 
@@ -329,11 +853,11 @@ RunFile* ArchiveIndex::openForScan(const RunId& runid)
 #else
         w_assert0(!directIO);
 #endif
-        file.fd = ::open(fpath.string().c_str(), flags, 0744 /*mode*/);
+        file.fd = backend->open(fpath.string(), flags, 0744 /*mode*/);
         CHECK_ERRNO(file.fd);
         file.length = ArchiveIndex::getFileSize(file.fd);
         if (file.length > 0) {
-            file.data = (char*) mmap(nullptr, file.length, PROT_READ, MAP_SHARED, file.fd, 0);
+            file.data = backend->mmap(file.fd, file.length);
             CHECK_ERRNO((long) file.data);
         }
         file.refcount = 0;
@@ -347,9 +871,9 @@ RunFile* ArchiveIndex::openForScan(const RunId& runid)
 	for (auto it = _open_files.cbegin(); it != _open_files.cend();) {
             if (it->second.refcount == 0) {
                 w_assert0(it->second.data);
-                auto ret = munmap(it->second.data, it->second.length);
+                auto ret = backend->munmap(it->second.data, it->second.length);
                 CHECK_ERRNO(ret);
-                ret = ::close(it->second.fd);
+                ret = backend->close(it->second.fd);
                 CHECK_ERRNO(ret);
                 it = _open_files.erase(it);
                 // CS TODO: fix XctLogger
@@ -408,12 +932,12 @@ void ArchiveIndex::deleteRuns(unsigned replicationFactor)
     spinlock_write_critical_section cs(&_mutex);
 
     if (replicationFactor == 0) { // delete all runs
-        fs::directory_iterator it(archpath), eod;
+        std::vector<string> fnames;
+        backend->list_directory(archpath.string(), fnames);
         boost::regex run_rx(run_regex, boost::regex::perl);
-        for (; it != eod; it++) {
-            string fname = it->path().filename().string();
+        for (auto& fname : fnames) {
             if (boost::regex_match(fname, run_rx)) {
-                fs::remove(it->path());
+                backend->remove((archpath / fname).string());
             }
         }
 
@@ -435,7 +959,7 @@ void ArchiveIndex::deleteRuns(unsigned replicationFactor)
                     if (low.begin >= high.begin && low.end <= high.end)
                     {
                         auto path = make_run_path(low.begin, low.end, levelToClean);
-                        fs::remove(path);
+                        backend->remove(path.string());
                     }
                 }
                 levelToClean--;
@@ -444,24 +968,38 @@ void ArchiveIndex::deleteRuns(unsigned replicationFactor)
     }
 }
 
-void ArchiveIndex::newBlock(const vector<pair<PageID, size_t> >&
-        buckets, unsigned level)
+void ArchiveIndex::newBlock(const vector<BlockEntry>& buckets, unsigned level)
 {
     spinlock_write_critical_section cs(&_mutex);
 
     size_t prevOffset = 0;
     for (size_t i = 0; i < buckets.size(); i++) {
-        BlockEntry e;
-        e.pid = buckets[i].first;
-        e.offset = buckets[i].second;
+        const BlockEntry& e = buckets[i];
         w_assert1(e.offset == 0 || e.offset > prevOffset);
         prevOffset = e.offset;
         runs[level].back().entries.push_back(e);
     }
 }
 
+/*
+ * Called when a page image shows up in a block other than the one where the
+ * bucket of its PID started, i.e., when the bucket entry was already added
+ * with newBlock.
+ */
+void ArchiveIndex::markPageImage(PageID pid, uint32_t version, unsigned level)
+{
+    spinlock_write_critical_section cs(&_mutex);
+
+    auto& entries = runs[level].back().entries;
+    if (entries.size() > 0 && entries.back().pid == pid) {
+        if (version > entries.back().imgVersion) {
+            entries.back().imgVersion = version;
+        }
+    }
+}
+
 void ArchiveIndex::finishRun(run_number_t begin, run_number_t end,
-        PageID maxPID, int fd, off_t offset, unsigned level)
+        PageID maxPID, int fd, off_t offset, unsigned level, lsn_t endLSN)
 {
     int lf;
     {
@@ -479,6 +1017,7 @@ void ArchiveIndex::finishRun(run_number_t begin, run_number_t end,
         runs[level][lf].begin = begin;
         runs[level][lf].end = end;
         runs[level][lf].maxPID = maxPID;
+        runs[level][lf].endLSN = endLSN;
     }
 
     if (offset > 0 && lf < (int) runs[level].size()) {
@@ -493,11 +1032,16 @@ void ArchiveIndex::serializeRunInfo(RunInfo& run, int fd, off_t offset)
     spinlock_read_critical_section cs(&_mutex);
     // Write whole vector at once
     auto index_size = sizeof(BlockEntry) * run.entries.size();
-    auto ret = ::pwrite(fd, &run.entries[0], index_size, offset);
+    auto ret = backend->pwrite(fd, &run.entries[0], index_size, offset);
+    CHECK_ERRNO(ret);
+    // Write end LSN
+    lsndata_t endLSN = run.endLSN.data();
+    ret = backend->pwrite(fd, &endLSN, sizeof(lsndata_t), offset + index_size);
     CHECK_ERRNO(ret);
     // Write run footer
-    RunFooter footer {static_cast<uint64_t>(offset), index_size, run.maxPID};
-    ret = ::pwrite(fd, &footer, sizeof(RunFooter), offset + index_size);
+    RunFooter footer {static_cast<uint64_t>(offset), index_size, run.maxPID,
+        RunFormatEndLSN};
+    ret = backend->pwrite(fd, &footer, sizeof(RunFooter), offset + index_size + sizeof(lsndata_t));
 }
 
 void ArchiveIndex::appendNewRun(unsigned level)
@@ -535,6 +1079,26 @@ run_number_t ArchiveIndex::getLastRun()
     return last;
 }
 
+lsn_t ArchiveIndex::getArchivedLSN()
+{
+    spinlock_read_critical_section cs(&_mutex);
+
+    const RunInfo* last = nullptr;
+    for (unsigned l = 1; l <= maxLevel; l++) {
+        if (lastFinished[l] >= 0) {
+            auto& run = runs[l][lastFinished[l]];
+            if (!last || run.end > last->end) { last = &run; }
+        }
+    }
+
+    if (!last) { return lsn_t(1, 0); }
+    if (!last->endLSN.is_null()) { return last->endLSN; }
+
+    // Runs without end LSN (e.g., merged ones) end on a partition boundary
+    w_assert0(run_sub(last->end) == RunSubMax);
+    return lsn_t(run_partition(last->end) + 1, 0);
+}
+
 run_number_t ArchiveIndex::getLastRun(unsigned level)
 {
     spinlock_read_critical_section cs(&_mutex);
@@ -569,6 +1133,12 @@ void ArchiveIndex::loadRunInfo(RunFile* runFile, const RunId& fstats)
         off_t footer_offset = runFile->length - sizeof(RunFooter);
         RunFooter footer = *(reinterpret_cast<RunFooter*>(runFile->getOffset(footer_offset)));
         run.maxPID = footer.maxPID;
+        run.hasImgMarkers = footer.format == RunFormatImgMarkers
+            || footer.format == RunFormatEndLSN;
+        if (footer.format == RunFormatEndLSN) {
+            run.endLSN = *(reinterpret_cast<lsndata_t*>(
+                        runFile->getOffset(footer.index_begin + footer.index_size)));
+        }
         // Get offset of first index entry
         w_assert0(runFile->length > footer.index_begin);
         w_assert0(runFile->length > sizeof(RunFooter) + footer.index_size);
@@ -591,14 +1161,69 @@ void ArchiveIndex::loadRunInfo(RunFile* runFile, const RunId& fstats)
     run.begin = fstats.begin;
     run.end = fstats.end;
 
-    if (fstats.level > maxLevel) {
-        maxLevel = fstats.level;
+    addRunInfo(std::move(run), fstats.level);
+}
+
+void ArchiveIndex::addRunInfo(RunInfo&& run, unsigned level)
+{
+    if (level > maxLevel) {
+        maxLevel = level;
         // level 0 reserved, so add 1
         runs.resize(maxLevel+1);
         lastFinished.resize(maxLevel+1, -1);
     }
-    runs[fstats.level].push_back(run);
-    lastFinished[fstats.level] = runs[fstats.level].size() - 1;
+    runs[level].push_back(std::move(run));
+    lastFinished[level] = runs[level].size() - 1;
+}
+
+void ArchiveIndex::getPIDBoundaries(size_t count, std::vector<PageID>& bounds)
+{
+    w_assert0(count > 0);
+    bounds.clear();
+    bounds.push_back(0);
+
+    // (PID, bytes) for each bucket of the runs scanned by a full restore
+    std::vector<std::pair<PageID, size_t>> sizes;
+    size_t total = 0;
+    {
+        spinlock_read_critical_section cs(&_mutex);
+
+        auto level = maxLevel;
+        run_number_t nextRun = 1;
+        while (level > 0) {
+            auto index = findRun(nextRun, level);
+            while ((int) index <= lastFinished[level]) {
+                auto& run = runs[level][index];
+                auto& entries = run.entries;
+                // Size of last bucket is unknown -- assume the run average
+                size_t avg = entries.size() > 1 ?
+                    entries.back().offset / (entries.size() - 1) : 1;
+                for (size_t i = 0; i < entries.size(); i++) {
+                    size_t bytes = i + 1 < entries.size() ?
+                        entries[i+1].offset - entries[i].offset : avg;
+                    sizes.emplace_back(entries[i].pid, bytes);
+                    total += bytes;
+                }
+                nextRun = run.end + 1;
+                index++;
+            }
+            level--;
+        }
+    }
+
+    if (count == 1 || total == 0) { return; }
+
+    std::sort(sizes.begin(), sizes.end());
+
+    size_t target = total / count;
+    size_t acc = 0;
+    for (auto& s : sizes) {
+        if (acc >= target * bounds.size() && s.first > bounds.back()) {
+            bounds.push_back(s.first);
+            if (bounds.size() == count) { break; }
+        }
+        acc += s.second;
+    }
 }
 
 size_t ArchiveIndex::findRun(run_number_t run, unsigned level)
@@ -5,6 +5,7 @@
 #include <list>
 #include <unordered_map>
 #include <map>
+#include <mutex>
 
 #define BOOST_FILESYSTEM_NO_DEPRECATED
 #include <boost/filesystem.hpp>
@@ -12,6 +13,8 @@ namespace fs = boost::filesystem;
 
 #include "latches.h"
 #include "lsn.h"
+#include "futex.h"
+#include "storage_backend.h"
 
 class RunRecycler;
 class log_storage;
@@ -100,6 +103,12 @@ public:
     struct BlockEntry {
         size_t offset;
         PageID pid;
+        // Version of the latest page image found in this bucket (0 if none).
+        // Occupies what used to be padding, so the on-disk entry size is unchanged.
+        uint32_t imgVersion;
+
+        BlockEntry() : offset(0), pid(0), imgVersion(0) {}
+        BlockEntry(PageID pid, size_t offset) : offset(offset), pid(pid), imgVersion(0) {}
     };
 
     struct RunInfo {
@@ -109,8 +118,18 @@ public:
         // Used as a filter to avoid unneccessary probes on older runs
         PageID maxPID;
 
+        // Whether imgVersion of the entries below can be trusted (i.e., run
+        // was not generated before page-image markers were introduced)
+        bool hasImgMarkers;
+
+        // LSN up to which the recovery log was consumed into this run (null
+        // if unknown, in which case the run must end on a partition boundary)
+        lsn_t endLSN;
+
         std::vector<BlockEntry> entries;
 
+        RunInfo() : begin(0), end(0), maxPID(0), hasImgMarkers(true), endLSN(lsn_t::null) {}
+
         bool operator<(const RunInfo& other) const
         {
             return begin < other.begin;
@@ -119,15 +138,68 @@ public:
 
     std::string getArchDir() const { return archdir; }
 
+    // Temporary files used by the log archiver to spill sorted sub-runs.
+    // They are not part of the archive and are deleted on startup.
+    std::string getSpillPath(run_number_t run, unsigned number) const;
+
     run_number_t getLastRun();
     run_number_t getLastRun(unsigned level);
     run_number_t getFirstRun(unsigned level);
 
+    /*
+     * Waits until a run with number at least run is closed, the timeout
+     * expires, or notifyRunWaiters() is called. Returns getLastRun() as of
+     * the last run closed, so callers should re-check it in a loop.
+     */
+    run_number_t waitForRun(run_number_t run, long timeoutMs = -1)
+    {
+        return static_cast<run_number_t>(_closedRuns.waitFor(run, timeoutMs));
+    }
+    void notifyRunWaiters() { _closedRuns.notify(); }
+
+    // LSN from which log archiving must resume
+    lsn_t getArchivedLSN();
+
     // run generation methods
     void openNewRun(unsigned level);
-    void append(char* data, size_t length, unsigned level);
+    void append(const char* data, size_t length, off_t offset, unsigned level);
     void fsync(unsigned level);
-    void closeCurrentRun(run_number_t currentRun, unsigned level, PageID maxPID = 0);
+    void closeCurrentRun(run_number_t currentRun, unsigned level, PageID maxPID = 0,
+            lsn_t endLSN = lsn_t::null);
+
+    /*
+     * Checkpoint of the run currently being generated, written next to its
+     * file. It records a prefix of the file, which is valid once synced,
+     * along with its index entries and how the run will be closed, so that
+     * generation can resume after a crash instead of starting the run over.
+     * The prefix ends where the bucket of resumePID begins, since later
+     * blocks may still add log records of that PID.
+     */
+    struct RunCheckpoint {
+        uint32_t magic;
+        uint32_t level;
+        // First run number of the run file, as given by closeCurrentRun
+        run_number_t begin;
+        // Run number used by the archiver and the one the run is closed as
+        run_number_t run;
+        run_number_t closeAs;
+        // LSN up to which the recovery log is consumed into this run
+        lsndata_t endLSN;
+        // Valid prefix of the run file and number of index entries in it
+        uint64_t length;
+        uint64_t entryCount;
+        // Log records of lower PIDs are all in the prefix
+        PageID resumePID;
+        uint32_t unused;
+    };
+    void checkpointRun(unsigned level, run_number_t run, run_number_t closeAs, lsn_t endLSN,
+            size_t length);
+    // Checkpoint of the unfinished run found at startup, if any
+    bool getRunCheckpoint(RunCheckpoint& ckpt);
+    void discardRunCheckpoint();
+    // Continue the unfinished run found at startup instead of opening a new
+    // one; returns its run number and the file offset where it continues
+    bool resumeRun(unsigned level, run_number_t& run, size_t& length);
 
     // run scanning methods
     RunFile* openForScan(const RunId& runid);
@@ -138,18 +210,41 @@ public:
     void deleteRuns(unsigned replicationFactor = 0);
 
     static bool parseRunFileName(std::string fname, RunId& fstats);
-    static size_t getFileSize(int fd);
+    size_t getFileSize(int fd);
 
-    void newBlock(const std::vector<std::pair<PageID, size_t> >& buckets, unsigned level);
+    // Same backend as the log storage given to the constructor
+    const std::shared_ptr<StorageBackend>& get_backend() const { return backend; }
+
+    void newBlock(const std::vector<BlockEntry>& buckets, unsigned level);
+    void markPageImage(PageID pid, uint32_t version, unsigned level);
 
     void finishRun(run_number_t first, run_number_t last, PageID maxPID,
-            int fd, off_t offset, unsigned level);
+            int fd, off_t offset, unsigned level, lsn_t endLSN = lsn_t::null);
 
     template <class Input>
     void probe(std::vector<Input>&, PageID, PageID, run_number_t runBegin,
             run_number_t& runEnd);
 
     void loadRunInfo(RunFile*, const RunId&);
+
+    /*
+     * Summary of a run file as recorded in the archive manifest, which is
+     * an append-only file with one entry per run closed. At startup, runs are
+     * taken from the manifest instead of listing the archive directory, and
+     * their indexes are read without parsing each run file's footer.
+     */
+    struct ManifestEntry {
+        uint32_t magic;
+        uint32_t level;
+        run_number_t begin;
+        run_number_t end;
+        uint64_t fileSize;
+        uint64_t indexBegin;
+        uint64_t indexSize;
+        lsndata_t endLSN;
+        PageID maxPID;
+        uint32_t format;
+    };
     void startNewRun(unsigned level);
 
     unsigned getMaxLevel() const { return maxLevel; }
@@ -161,6 +256,14 @@ public:
     void dumpIndex(std::ostream& out);
     void dumpIndex(std::ostream& out, const RunId& runid);
 
+    /*
+     * Splits the PID space into (at most) count ranges holding roughly the
+     * same amount of archived log, based on the bucket sizes of the run
+     * indexes. The first PID of each range is added to bounds, the first one
+     * being always zero; the last range is unbounded.
+     */
+    void getPIDBoundaries(size_t count, std::vector<PageID>& bounds);
+
     template <class OutputIter>
     void listRunsNonOverlapping(OutputIter out)
     {
@@ -190,7 +293,34 @@ private:
     // binary search
     size_t findEntry(RunInfo* run, PageID pid,
             int from = -1, int to = -1);
+    bool hasPageImage(const RunInfo& run, size_t entry, PageID pid) const
+    {
+        return run.hasImgMarkers && run.entries[entry].pid == pid
+            && run.entries[entry].imgVersion > 0;
+    }
     void serializeRunInfo(RunInfo&, int fd, off_t);
+    void addRunInfo(RunInfo&& run, unsigned level);
+
+    // Startup: list the run files and delete leftovers of a crash; returns
+    // whether the unfinished run of level 1 was found
+    bool listDirectory(bool reformat, std::vector<RunId>& found);
+    // Startup: same as above, but without listing, for runs from the manifest
+    bool removeLeftovers(const std::vector<RunId>& found);
+    // Startup: read the given runs (in parallel), using manifest entries
+    // where they match the run files. Returns whether the manifest was
+    // consistent with the runs found.
+    bool loadRuns(const std::vector<RunId>& found,
+            const std::unordered_map<RunId, ManifestEntry>& manifest,
+            std::vector<RunInfo>& loaded, std::vector<ManifestEntry>& entries);
+    bool readRunInfo(const RunId& runid, const ManifestEntry* known, RunInfo& run,
+            ManifestEntry& entry);
+    bool readManifest(std::unordered_map<RunId, ManifestEntry>& manifest);
+    void rewriteManifest(const std::vector<ManifestEntry>& entries);
+    void appendManifest(const RunId& runid, int fd);
+
+    // Startup: keep the unfinished run file if its checkpoint follows the
+    // last finished run; otherwise delete it
+    void recoverUnfinishedRun();
 
 private:
     std::string archdir;
@@ -199,6 +329,8 @@ private:
 
     fs::path archpath;
 
+    std::shared_ptr<StorageBackend> backend;
+
     // Run information for each level of the index
     std::vector<std::vector<RunInfo>> runs;
 
@@ -210,10 +342,22 @@ private:
 
     unsigned maxLevel;
 
+    // Append-only manifest of closed runs
+    int manifestFd;
+    std::mutex manifestMutex;
+
+    // Unfinished run found at startup and not resumed yet
+    bool hasResumableRun;
+    RunCheckpoint resumeCkpt;
+    std::vector<BlockEntry> resumeEntries;
+
     std::unique_ptr<RunRecycler> runRecycler;
 
     mutable srwlock_t _mutex;
 
+    // Last run closed on any level (i.e., getLastRun())
+    SeqNotifier _closedRuns;
+
     /// Cache for open files (for scans only)
     std::map<RunId, RunFile, CmpOpenFiles> _open_files;
     mutable srwlock_t _open_file_mutex;
@@ -222,12 +366,18 @@ private:
 
     fs::path make_run_path(run_number_t begin, run_number_t end, unsigned level = 1) const;
     fs::path make_current_run_path(unsigned level) const;
+    fs::path make_checkpoint_path(unsigned level) const;
 
 public:
     const static std::string RUN_PREFIX;
     const static std::string CURR_RUN_PREFIX;
     const static std::string run_regex;
     const static std::string current_regex;
+    const static std::string CKPT_SUFFIX;
+    const static std::string checkpoint_regex;
+    const static std::string SPILL_PREFIX;
+    const static std::string spill_regex;
+    const static std::string MANIFEST_NAME;
 };
 
 template <class Input>
@@ -236,12 +386,25 @@ void ArchiveIndex::probe(std::vector<Input>& inputs,
 {
     spinlock_read_critical_section cs(&_mutex);
 
+    struct Candidate {
+        RunId runid;
+        size_t offset;
+        bool hasImg;
+    };
+    static thread_local std::vector<Candidate> candidates;
+    candidates.clear();
+
     Input input;
     input.endPID = endPID;
     unsigned level = maxLevel;
     inputs.clear();
     run_number_t nextRun = runBegin;
+    // If no run is found, nothing beyond runBegin was probed
+    run_number_t lastRun = runBegin > 0 ? runBegin - 1 : 0;
+    const bool singlePage = (endPID == startPID + 1);
 
+    // First pass only consults the in-memory index; runs are collected from
+    // oldest to newest and no file is opened yet
     while (level > 0) {
         if (runEnd > 0 && nextRun > runEnd) { break; }
 
@@ -250,6 +413,7 @@ void ArchiveIndex::probe(std::vector<Input>& inputs,
             auto& run = runs[level][index];
             index++;
             nextRun = run.end;
+            lastRun = run.end;
 
             if (startPID > run.maxPID) {
                 // INC_TSTAT(la_avoided_probes);
@@ -264,19 +428,37 @@ void ArchiveIndex::probe(std::vector<Input>& inputs,
                     continue;
                 }
 
-                input.pos = run.entries[entryBegin].offset;
-                input.runFile =
-                    openForScan(RunId{run.begin, run.end, level});
-                w_assert1(input.pos < input.runFile->length);
-                inputs.push_back(input);
+                candidates.push_back(Candidate{RunId{run.begin, run.end, level},
+                        run.entries[entryBegin].offset,
+                        singlePage && hasPageImage(run, entryBegin, startPID)});
             }
         }
 
         level--;
     }
 
+    // For single-page probes, the newest run holding a page image makes all
+    // older runs irrelevant, so they don't even have to be opened
+    size_t first = 0;
+    if (singlePage) {
+        for (size_t i = candidates.size(); i > 0; i--) {
+            if (candidates[i-1].hasImg) {
+                // INC_TSTAT(la_img_skipped_runs, i-1);
+                first = i-1;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = first; i < candidates.size(); i++) {
+        input.pos = candidates[i].offset;
+        input.runFile = openForScan(candidates[i].runid);
+        w_assert1(input.pos < input.runFile->length);
+        inputs.push_back(input);
+    }
+
     // Return last probed run as out-parameter
-    runEnd = nextRun;
+    runEnd = lastRun;
 }
 
 #endif
@@ -0,0 +1,169 @@
+#ifndef FINELOG_LOGARCHIVE_RESTORE_H
+#define FINELOG_LOGARCHIVE_RESTORE_H
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "logarchive_index.h"
+#include "logarchive_scanner.h"
+#include "logrec.h"
+
+/** \brief Parallel restore of all pages from the log archive
+ *
+ * The PID space is split into segments holding roughly the same amount of
+ * archived log (see ArchiveIndex::getPIDBoundaries). Worker threads pull
+ * segments in PID order and replay each of them with their own ArchiveScan,
+ * which merges all non-overlapping runs of the archive for that PID range.
+ * There are more segments than workers, so that skewed ranges are balanced.
+ *
+ * Restored pages are handed over to a user-supplied Sink, which must be
+ * thread-safe and provide:
+ * - Node* fix(PageID pid): returns an empty node into which the log records
+ *   of the given page are replayed
+ * - void unfix(PageID pid, Node* node): called once all log records of the
+ *   page were replayed, e.g., to write it to the replacement device
+ *
+ * The Sink provides backpressure: if pages cannot be written out fast enough,
+ * fix() may simply block until a free node is available, which stalls the
+ * worker. Log records are replayed with Redoer::redo(lr, node) and filtered
+ * as in NodeFetch, i.e., records before the first page image of a page are
+ * skipped, and pages without any record left to replay are not fixed.
+ *
+ * If a worker fails with an exception, the remaining segments are
+ * abandoned and the exception is rethrown by join().
+ */
+template <typename Redoer, typename Sink>
+class ArchiveRestore
+{
+public:
+    ArchiveRestore(std::shared_ptr<ArchiveIndex> archIndex, Sink& sink,
+            size_t workerCount, size_t segmentsPerWorker = DFT_SEGMENTS_PER_WORKER)
+        : archIndex(archIndex), sink(sink), workerCount(workerCount),
+        nextSegment(0), restoredSegments(0), restoredPages(0), replayedLogrecs(0)
+    {
+        w_assert0(workerCount > 0 && segmentsPerWorker > 0);
+        archIndex->getPIDBoundaries(workerCount * segmentsPerWorker, segments);
+    }
+
+    ~ArchiveRestore()
+    {
+        joinWorkers();
+    }
+
+    void fork()
+    {
+        for (size_t i = 0; i < workerCount; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    void join()
+    {
+        joinWorkers();
+        if (error) {
+            auto e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    // Progress information
+    size_t getSegmentCount() const { return segments.size(); }
+    size_t getRestoredSegments() const { return restoredSegments; }
+    size_t getRestoredPages() const { return restoredPages; }
+    size_t getReplayedLogrecs() const { return replayedLogrecs; }
+    bool finished() const { return restoredSegments == segments.size(); }
+
+    const static size_t DFT_SEGMENTS_PER_WORKER = 4;
+
+private:
+    std::shared_ptr<ArchiveIndex> archIndex;
+    Sink& sink;
+    const size_t workerCount;
+    std::vector<std::thread> workers;
+
+    // First PID of each segment; the last one is unbounded
+    std::vector<PageID> segments;
+    std::atomic<size_t> nextSegment;
+
+    std::atomic<size_t> restoredSegments;
+    std::atomic<size_t> restoredPages;
+    std::atomic<size_t> replayedLogrecs;
+
+    // First exception thrown by a worker
+    std::exception_ptr error;
+    std::mutex errorMutex;
+
+    void joinWorkers()
+    {
+        for (auto& t : workers) { t.join(); }
+        workers.clear();
+    }
+
+    void work()
+    {
+        try {
+            restoreSegments();
+        }
+        catch (...) {
+            std::unique_lock<std::mutex> lck{errorMutex};
+            if (!error) { error = std::current_exception(); }
+            // Other workers stop after their current segment
+            nextSegment = segments.size();
+        }
+    }
+
+    void restoreSegments()
+    {
+        // Merge inputs are thread-local, so each worker needs its own scan
+        ArchiveScan scan{archIndex};
+        ReplayFilter filter;
+        constexpr size_t BatchSize = 64;
+        logrec_t* batch[BatchSize];
+
+        while (true) {
+            size_t s = nextSegment++;
+            if (s >= segments.size()) { break; }
+
+            PageID startPID = segments[s];
+            PageID endPID = s + 1 < segments.size() ? segments[s+1] : 0;
+            scan.open(startPID, endPID);
+
+            PageID pid = 0;
+            bool firstPage = true;
+            decltype(sink.fix(pid)) node = nullptr;
+            size_t pages = 0, logrecs = 0;
+
+            while (size_t count = scan.nextBatch(batch, BatchSize)) {
+                for (size_t i = 0; i < count; i++) {
+                    auto lr = batch[i];
+                    if (firstPage || lr->pid() != pid) {
+                        if (node) { sink.unfix(pid, node); }
+                        node = nullptr;
+                        pid = lr->pid();
+                        firstPage = false;
+                        filter.reset();
+                    }
+                    if (!filter.shouldRedo(lr)) { continue; }
+                    if (!node) {
+                        node = sink.fix(pid);
+                        pages++;
+                    }
+                    Redoer::redo(lr, node);
+                    logrecs++;
+                }
+            }
+            if (node) { sink.unfix(pid, node); }
+
+            restoredPages += pages;
+            replayedLogrecs += logrecs;
+            restoredSegments++;
+        }
+    }
+};
+
+#endif
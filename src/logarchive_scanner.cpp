@@ -6,6 +6,7 @@
 #include "log_consumer.h" // for LogScanner
 
 thread_local std::vector<MergeInput> ArchiveScan::_mergeInputVector;
+thread_local ArchiveScan* ArchiveScan::_mergeInputOwner = nullptr;
 
 bool mergeInputCmpGt(const MergeInput& a, const MergeInput& b)
 {
@@ -14,9 +15,12 @@ bool mergeInputCmpGt(const MergeInput& a, const MergeInput& b)
 }
 
 ArchiveScan::ArchiveScan(std::shared_ptr<ArchiveIndex> archIndex)
-    : archIndex(archIndex), prevVersion(0), prevPID(0), singlePage(false), lastProbedRun(0)
+    : archIndex(archIndex), startPID(0), endPID(0), prevVersion(0), prevPID(0),
+    singlePage(false), lastProbedRun(0)
 {
-    clear();
+    // Merge inputs of other scans on this thread are left untouched
+    heapBegin = _mergeInputVector.end();
+    heapEnd = _mergeInputVector.end();
 }
 
 void ArchiveScan::open(PageID startPID, PageID endPID, run_number_t runBegin,
@@ -25,10 +29,13 @@ void ArchiveScan::open(PageID startPID, PageID endPID, run_number_t runBegin,
     w_assert0(archIndex);
     clear();
     auto& inputs = _mergeInputVector;
+    _mergeInputOwner = this;
 
     archIndex->probe(inputs, startPID, endPID, runBegin, runEnd);
     lastProbedRun = runEnd;
 
+    this->startPID = startPID;
+    this->endPID = endPID;
     singlePage = (endPID == startPID+1);
 
     heapBegin = inputs.begin();
@@ -55,6 +62,63 @@ void ArchiveScan::open(PageID startPID, PageID endPID, run_number_t runBegin,
     std::make_heap(heapBegin, heapEnd, mergeInputCmpGt);
 }
 
+void ArchiveScan::reopen(PageID startPID, PageID endPID, run_number_t runEnd)
+{
+    w_assert0(archIndex);
+    if (_mergeInputOwner != this || startPID != this->startPID || endPID != this->endPID) {
+        open(startPID, endPID, lastProbedRun + 1, runEnd);
+        return;
+    }
+
+    static thread_local std::vector<MergeInput> newInputs;
+    archIndex->probe(newInputs, startPID, endPID, lastProbedRun + 1, runEnd);
+    lastProbedRun = runEnd;
+    if (newInputs.empty()) { return; }
+
+    auto& inputs = _mergeInputVector;
+
+    // Keep only inputs still in the heap; the ones trimmed by a page image or
+    // already finished are closed. Moving the heap range to the front of the
+    // vector preserves the heap property.
+    size_t begin = heapBegin - inputs.begin();
+    size_t end = heapEnd - inputs.begin();
+    size_t kept = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (i >= begin && i < end) { inputs[kept++] = inputs[i]; }
+        else { archIndex->closeScan(inputs[i].runFile->runid); }
+    }
+    inputs.resize(kept);
+
+    // Open new inputs from newest to oldest; as in open, a page image makes
+    // all older inputs irrelevant
+    bool imgFound = false;
+    size_t opened = newInputs.size();
+    for (size_t i = newInputs.size(); i > 0; i--) {
+        auto& input = newInputs[i-1];
+        if (!imgFound && input.open(startPID)) {
+            imgFound = singlePage && input.logrec()->has_page_img();
+            newInputs[--opened] = input;
+        }
+        else {
+            archIndex->closeScan(input.runFile->runid);
+        }
+    }
+
+    if (imgFound) {
+        for (auto& input : inputs) {
+            archIndex->closeScan(input.runFile->runid);
+        }
+        inputs.clear();
+    }
+
+    inputs.insert(inputs.end(), newInputs.begin() + opened, newInputs.end());
+    newInputs.clear();
+
+    heapBegin = inputs.begin();
+    heapEnd = inputs.end();
+    std::make_heap(heapBegin, heapEnd, mergeInputCmpGt);
+}
+
 bool ArchiveScan::finished()
 {
     return heapBegin == heapEnd;
@@ -113,9 +177,44 @@ bool ArchiveScan::next(logrec_t*& lr)
     return true;
 }
 
+size_t ArchiveScan::nextBatch(logrec_t** out, size_t max)
+{
+    w_assert1(max > 0);
+    if (finished()) { return 0; }
+
+    std::pop_heap(heapBegin, heapEnd, mergeInputCmpGt);
+    auto top = std::prev(heapEnd);
+    if (top->finished()) {
+        heapEnd--;
+        return nextBatch(out, max);
+    }
+
+    // After the pop, the remaining heap is [heapBegin, top) and its smallest
+    // element is at heapBegin
+    size_t count = 0;
+    do {
+        auto lr = top->logrec();
+        w_assert1(lr->page_version() == top->keyVersion && lr->pid() == top->keyPID);
+        out[count++] = lr;
+        top->next();
+    } while (count < max && !top->finished()
+            && (heapBegin == top || !mergeInputCmpGt(*top, *heapBegin)));
+
+    std::push_heap(heapBegin, heapEnd, mergeInputCmpGt);
+
+    prevVersion = out[count-1]->page_version();
+    prevPID = out[count-1]->pid();
+
+    return count;
+}
+
 ArchiveScan::~ArchiveScan()
 {
-    clear();
+    // Do not close inputs that were taken over by another scan
+    if (_mergeInputOwner == this) {
+        clear();
+        _mergeInputOwner = nullptr;
+    }
 }
 
 void ArchiveScan::dumpHeap()
@@ -6,6 +6,7 @@
 #include <vector>
 
 #include "logarchive_index.h"
+#include "logrec.h"
 
 class ArchiveIndex;
 class logrec_t;
@@ -41,6 +42,23 @@ public:
     bool next(logrec_t*&);
     bool finished();
 
+    /*
+     * Fills out with up to max consecutive log records from the input at the
+     * top of the merge heap, as long as they precede the records of all other
+     * inputs. The heap is only touched once per batch. Returns the number of
+     * records delivered, which is zero only if the scan is finished.
+     */
+    size_t nextBatch(logrec_t** out, size_t max);
+
+    /*
+     * Like open, but only probes runs finished after the last probed one.
+     * Inputs that are still positioned in the merge heap are kept, so that
+     * repeated fetches of the same page range do not start from scratch.
+     * Falls back to a full open on the new runs if the range differs or if
+     * another scan on this thread took over the merge inputs.
+     */
+    void reopen(PageID startPID, PageID endPID, run_number_t runEnd = 0);
+
 
     template <class Iter> void openForMerge(Iter begin, Iter end);
     run_number_t getLastProbedRun() const { return lastProbedRun; }
@@ -49,11 +67,15 @@ public:
 private:
     // Thread-local storage for merge inputs
     static thread_local std::vector<MergeInput> _mergeInputVector;
+    // Scan which currently owns the thread-local merge inputs
+    static thread_local ArchiveScan* _mergeInputOwner;
 
     std::vector<MergeInput>::iterator heapBegin;
     std::vector<MergeInput>::iterator heapEnd;
 
     std::shared_ptr<ArchiveIndex> archIndex;
+    PageID startPID;
+    PageID endPID;
     uint32_t prevVersion;
     PageID prevPID;
     bool singlePage;
@@ -64,12 +86,52 @@ private:
 
 bool mergeInputCmpGt(const MergeInput& a, const MergeInput& b);
 
+/*
+ * Decides which of the log records of a page delivered by a scan must be
+ * replayed: all records before the first page image of the page are skipped.
+ * Used by NodeFetch and ArchiveRestore, which must call reset() whenever they
+ * move on to another page.
+ */
+class ReplayFilter {
+public:
+    void reset() { img_consumed = false; }
+
+    bool shouldRedo(const logrec_t* lr)
+    {
+        assert(lr->valid_header());
+        assert(lr->is_redo());
+        assert(lr->page_version() > 0);
+        // TODO: only assert this if Node type is actually a page
+        // assert(p.pid() == lr->pid());
+        // assert(lr->has_page_img() || p.version() > 0);
+        // assert(p.version() < lr->page_version());
+
+        // This is a hack to circumvent a problem with page-img compression. Since it is an SSX,
+        // it may appear in the log before a page update with lower version. Usually, that's not a
+        // problem, because the updates will be ordered by version when scanning. But, in the
+        // special case where the lower update ends up in the next log file, it will not be
+        // eliminated by page-img compression, and thus NodeFetch will not see the page image
+        // as the first log record. This is fixed with the check below.
+        if (lr->has_page_img()) {
+            img_consumed = true;
+        }
+        else if (!img_consumed) {
+            return false;
+        }
+        return true;
+    }
+
+private:
+    bool img_consumed = false;
+};
+
 template <class Iter>
 void ArchiveScan::openForMerge(Iter begin, Iter end)
 {
     w_assert0(archIndex);
     clear();
     auto& inputs = _mergeInputVector;
+    _mergeInputOwner = this;
 
     for (Iter it = begin; it != end; it++) {
         MergeInput input;
@@ -10,16 +10,30 @@ using namespace std;
 const static int IO_BLOCK_COUNT = 8;
 
 BlockAssembly::BlockAssembly(ArchiveIndex* index, size_t blockSize, unsigned level, bool compression,
-        unsigned fsyncFrequency)
-    : dest(nullptr), blockSize(blockSize), lastRun(0), currentPID(0), enableCompression(compression), level(level),
+        unsigned fsyncFrequency, unsigned writerCount, unsigned checkpointFrequency)
+    : dest(nullptr), blockSize(blockSize), fpos(0), blockOffset(0), blockSeq(0),
+    epoch(0), runClosed(true), closePrev(0), lastRun(0), cutAs(0), cutLSN(lsn_t::null),
+    currentPID(0), enableCompression(compression), level(level),
     maxPID(numeric_limits<PageID>::min())
 {
+    w_assert0(writerCount > 0);
     archIndex = index;
-    writebuf = make_shared<AsyncRingBuffer>(blockSize, IO_BLOCK_COUNT);
-    writer = make_unique<WriterThread>(writebuf, index, level, fsyncFrequency);
-    writer->fork();
+    barrier = make_shared<RunBarrier>(index, level, fsyncFrequency, checkpointFrequency);
 
-    index->openNewRun(level);
+    writebuf = make_shared<AsyncRingBufferMPMC>(blockSize, IO_BLOCK_COUNT, sizeof(BlockHeader));
+    for (unsigned i = 0; i < writerCount; i++) {
+        writers.push_back(make_unique<WriterThread>(writebuf, barrier, index, level));
+        writers.back()->fork();
+    }
+
+    // Unfinished run left by a crash is continued after its valid prefix
+    if (index->resumeRun(level, lastRun, fpos)) {
+        runClosed = false;
+        currentPID = numeric_limits<PageID>::max();
+    }
+    else {
+        index->openNewRun(level);
+    }
 }
 
 BlockAssembly::~BlockAssembly()
@@ -34,25 +48,13 @@ bool BlockAssembly::hasPendingBlocks()
     return !writebuf->isEmpty();
 }
 
-run_number_t BlockAssembly::getRunFromBlock(const char* b)
-{
-    BlockHeader* h = (BlockHeader*) b;
-    return h->run;
-}
-
-PageID BlockAssembly::getMaxPIDFromBlock(const char* b)
-{
-    BlockHeader* h = (BlockHeader*) b;
-    return h->maxPID;
-}
-
-size_t BlockAssembly::getEndOfBlock(const char* b)
+const BlockAssembly::BlockHeader* BlockAssembly::getHeader(RingBufferBase* buf, const char* b)
 {
-    BlockHeader* h = (BlockHeader*) b;
-    return h->end;
+    w_assert1(buf->getMetadataSize() == sizeof(BlockHeader));
+    return reinterpret_cast<BlockHeader*>(buf->getMetadata(b));
 }
 
-bool BlockAssembly::start(run_number_t run)
+bool BlockAssembly::start(run_number_t run, run_number_t closeAs, lsn_t cutLSN)
 {
     DBGTHRD(<< "Requesting write block for selection");
     dest = writebuf->producerRequest();
@@ -65,14 +67,26 @@ bool BlockAssembly::start(run_number_t run)
     }
     DBGTHRD(<< "Picked block for selection " << (void*) dest);
 
+    closePrev = 0;
     if (run != lastRun) {
+        // Previous run was not closed with finish, so the writer that gets
+        // this block must close it first
+        if (!runClosed) {
+            closePrev = lastRun;
+            epoch++;
+        }
         archIndex->startNewRun(level);
         fpos = 0;
         lastRun = run;
+        runClosed = false;
         currentPID = numeric_limits<PageID>::max();
     }
 
-    pos = sizeof(BlockHeader);
+    this->cutAs = closeAs;
+    this->cutLSN = cutLSN;
+
+    pos = 0;
+    blockOffset = fpos;
     currentPIDpos = pos;
     currentPIDfpos = fpos;
     maxPID = numeric_limits<PageID>::min();
@@ -86,14 +100,15 @@ bool BlockAssembly::add(logrec_t* lr)
     w_assert0(dest);
     w_assert1(lr->valid_header());
 
-    // Verify if we still have space for this log record (account for skip log record)
-    size_t available = blockSize - (pos + sizeof(baseLogHeader));
+    // Verify if we still have space for this log record (the skip log record
+    // at the end of the block is written separately, see ArchiveIndex::append)
+    size_t available = blockSize - pos;
     w_assert1(available <= blockSize);
     if (lr->length() > available) {
         // If this is a page_img logrec, we might still have space for it because
         // the preceding log records of the same PID will be dropped
         if (enableCompression && lr->has_page_img()) {
-            size_t imgAvailable = blockSize - (currentPIDpos + sizeof(baseLogHeader));
+            size_t imgAvailable = blockSize - currentPIDpos;
             bool hasSpaceForPageImg = lr->pid() == currentPID && lr->length() < imgAvailable;
             if (!hasSpaceForPageImg) { return false; }
         }
@@ -109,6 +124,18 @@ bool BlockAssembly::add(logrec_t* lr)
         if (currentPID > maxPID) { maxPID = currentPID; }
     }
 
+    if (lr->has_page_img()) {
+        // Mark bucket so that single-page probes may skip older runs
+        if (buckets.size() > 0 && buckets.back().pid == currentPID) {
+            auto& e = buckets.back();
+            if (lr->page_version() > e.imgVersion) { e.imgVersion = lr->page_version(); }
+        }
+        else {
+            // bucket started on a previous block, which is already in the index
+            archIndex->markPageImage(currentPID, lr->page_version(), level);
+        }
+    }
+
     if (enableCompression && lr->has_page_img()) {
         // Keep track of compression efficicency
         // ADD_TSTAT(la_img_compressed_bytes, pos - currentPIDpos);
@@ -116,7 +143,6 @@ bool BlockAssembly::add(logrec_t* lr)
         pos = currentPIDpos;
         fpos = currentPIDfpos;
     }
-    w_assert1(pos > 0 || fpos % blockSize == 0);
 
     memcpy(dest + pos, lr, lr->length());
 
@@ -125,7 +151,7 @@ bool BlockAssembly::add(logrec_t* lr)
     return true;
 }
 
-void BlockAssembly::finish()
+void BlockAssembly::finish(run_number_t closeRun, lsn_t endLSN)
 {
     DBGTHRD("Selection produced block for writing " << (void*) dest <<
             " in run " << (int) lastRun << " with end " << pos);
@@ -135,15 +161,29 @@ void BlockAssembly::finish()
     archIndex->newBlock(buckets, level);
 
     // write block header info
-    BlockHeader* h = (BlockHeader*) dest;
+    BlockHeader* h = reinterpret_cast<BlockHeader*>(writebuf->getMetadata(dest));
     h->run = lastRun;
     h->end = pos;
     h->maxPID = maxPID;
+    h->closeRun = closeRun;
+    h->endLSN = endLSN;
+    h->offset = blockOffset;
+    h->seq = blockSeq++;
+    h->epoch = epoch;
+    h->closePrev = closePrev;
+    h->cutAs = cutAs;
+    h->cutLSN = cutLSN;
+    w_assert1(blockOffset + pos == fpos);
+
+    if (closeRun > 0) {
+        runClosed = true;
+        epoch++;
+    }
 
     // does not apply in FINELINE
 // #if W_DEBUG_LEVEL>=3
 //     // verify that all log records are within end boundary
-//     size_t vpos = sizeof(BlockHeader);
+//     size_t vpos = 0;
 //     while (vpos < pos) {
 //         logrec_t* lr = (logrec_t*) (dest + vpos);
 //         w_assert3(lr->lsn_ck() < h->lsn);
@@ -151,7 +191,7 @@ void BlockAssembly::finish()
 //     }
 // #endif
 
-    writebuf->producerRelease();
+    writebuf->producerRelease(dest);
     dest = NULL;
 }
 
@@ -159,7 +199,87 @@ void BlockAssembly::shutdown()
 {
     w_assert0(!dest);
     writebuf->set_finished();
-    writer->join();
+    for (auto& w : writers) {
+        w->join();
+    }
+}
+
+RunBarrier::RunBarrier(ArchiveIndex* index, unsigned level, unsigned fsyncFrequency,
+        unsigned checkpointFrequency)
+    : index(index), level(level), fsyncFrequency(fsyncFrequency),
+    checkpointFrequency(checkpointFrequency), written(0), epoch(0),
+    maxPIDInRun(numeric_limits<PageID>::min()), contiguous(0), sinceCheckpoint(0)
+{
+}
+
+void RunBarrier::closeRun(run_number_t run, lsn_t endLSN)
+{
+    index->closeCurrentRun(run, level, maxPIDInRun, endLSN);
+    DBGTHRD(<< "Closed run " << run);
+    maxPIDInRun = numeric_limits<PageID>::min();
+    epoch++;
+}
+
+void RunBarrier::enter(const BlockAssembly::BlockHeader& h)
+{
+    std::unique_lock<std::mutex> lck{mtx};
+
+    if (h.closePrev > 0 && epoch < h.epoch) {
+        // All blocks of the previous run come before this one
+        w_assert1(h.epoch == epoch + 1);
+        cond.wait(lck, [&] { return written == h.seq; });
+        closeRun(h.closePrev, lsn_t::null);
+        cond.notify_all();
+    }
+
+    cond.wait(lck, [&] { return epoch >= h.epoch; });
+}
+
+void RunBarrier::leave(const BlockAssembly::BlockHeader& h)
+{
+    std::unique_lock<std::mutex> lck{mtx};
+
+    written++;
+    if (h.maxPID > maxPIDInRun) { maxPIDInRun = h.maxPID; }
+
+    if (h.closeRun > 0) {
+        cond.wait(lck, [&] { return written == h.seq + 1; });
+        closeRun(h.closeRun, h.endLSN);
+    }
+    else if (fsyncFrequency > 0 && written % fsyncFrequency == 0) {
+        // Run file cannot be closed while we hold the latch
+        index->fsync(level);
+    }
+
+    if (checkpointFrequency > 0) { checkpoint(h); }
+
+    cond.notify_all();
+}
+
+/*
+ * Must be called after the block's run is closed, if it closes one, so that
+ * the run checkpointed is always the one currently open in the index.
+ */
+void RunBarrier::checkpoint(const BlockAssembly::BlockHeader& h)
+{
+    writtenAhead[h.seq] = h;
+    bool advanced = false;
+    BlockAssembly::BlockHeader last;
+    while (!writtenAhead.empty() && writtenAhead.begin()->first == contiguous) {
+        last = writtenAhead.begin()->second;
+        writtenAhead.erase(writtenAhead.begin());
+        contiguous++;
+        sinceCheckpoint++;
+        advanced = true;
+    }
+
+    if (!advanced || sinceCheckpoint < checkpointFrequency) { return; }
+    // A closed run needs no checkpoint, and one of unknown boundary cannot
+    // be resumed
+    if (last.closeRun > 0 || last.cutAs == 0) { return; }
+
+    index->checkpointRun(level, last.run, last.cutAs, last.cutLSN, last.offset + last.end);
+    sinceCheckpoint = 0;
 }
 
 void WriterThread::run()
@@ -181,52 +301,25 @@ void WriterThread::run()
              * that all pending blocks are written out before shutdown.
              */
             DBGTHRD(<< "Finished flag set on writer thread");
-            // index->closeCurrentRun(currentRun, level, maxPIDInRun);
             return; // finished is set on buf
         }
 
-        run_number_t run = BlockAssembly::getRunFromBlock(src);
+        // Copy header, since the block is released before the run is closed
+        const BlockAssembly::BlockHeader header = *BlockAssembly::getHeader(buf.get(), src);
 
-        DBGTHRD(<< "Picked block for write " << (void*) src << " in run " << run);
+        DBGTHRD(<< "Picked block for write " << (void*) src << " in run " << header.run);
 
-        if (currentRun == 0) {
-            // Initialize currentRun lazily (0 == invalid value)
-            DBGTHRD(<< "Lazy initialization of run " << run);
-            currentRun = run;
-        }
-        if (currentRun != run) {
-            // when writer is restarted, currentRun resets to zero
-            w_assert1(currentRun == 0 || run == currentRun + 1);
-            /*
-             * Selection (producer) guarantees that logrec fits in block.
-             * lastLSN is the LSN of the first log record in the new block
-             * -- it will be used as the upper bound when renaming the file
-             *  of the current run. This same LSN will be used as lower
-             *  bound on the next run, which allows us to verify whether
-             *  holes exist in the archive.
-             */
-            index->closeCurrentRun(currentRun, level, maxPIDInRun);
-            DBGTHRD(<< "Opening file for new run " << run);
-            currentRun = run;
-        }
-
-        PageID maxPID = BlockAssembly::getMaxPIDFromBlock(src);
-        if (maxPID > maxPIDInRun) { maxPIDInRun = maxPID; }
-
-        size_t blockEnd = BlockAssembly::getEndOfBlock(src);
-        size_t actualBlockSize= blockEnd - sizeof(BlockAssembly::BlockHeader);
-        memmove(src, src + sizeof(BlockAssembly::BlockHeader), actualBlockSize);
+        barrier->enter(header);
 
-        index->append(src, actualBlockSize, level);
+        // Blocks that only close the run are empty
+        if (header.end > 0) {
+            index->append(src, header.end, header.offset, level);
+        }
 
         DBGTHRD(<< "Wrote out block " << (void*) src
-                << " in run " << run);
-
-        buf->consumerRelease();
+                << " in run " << header.run);
 
-        if (fsyncFrequency > 0 && (++appendBlockCount % fsyncFrequency == 0)) {
-            index->fsync(level);
-        }
+        buf->consumerRelease(src);
+        barrier->leave(header);
     }
-    index->fsync(level);
 }
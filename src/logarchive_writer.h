@@ -2,54 +2,48 @@
 #define FINELOG_LOGARCHIVE_WRITER_H
 
 #include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
 
 #include "finelog_basics.h"
 #include "lsn.h"
 #include "thread_wrapper.h"
+#include "logarchive_index.h"
 
-class AsyncRingBuffer;
-class ArchiveIndex;
+class RingBufferBase;
+class AsyncRingBufferMPMC;
 class logrec_t;
+class RunBarrier;
 
 /** \brief Asynchronous writer thread to produce run files on disk
  *
  * Consumes blocks of data produced by the BlockAssembly component and
  * writes them to the corresponding run files on disk. Metadata on each
  * block is used to control to which run each block belongs and what LSN
- * ranges are contained in each run (see BlockAssembly).
+ * ranges are contained in each run (see BlockAssembly). Several writer
+ * threads may write blocks of the same run concurrently, in which case run
+ * boundaries are coordinated with a RunBarrier.
  *
  * \author Caetano Sauer
  */
 class WriterThread : public thread_wrapper_t {
 private:
 
-    std::shared_ptr<AsyncRingBuffer> buf;
+    std::shared_ptr<AsyncRingBufferMPMC> buf;
+    std::shared_ptr<RunBarrier> barrier;
     ArchiveIndex* index;
-    unsigned fsyncFrequency;
-    run_number_t currentRun;
     unsigned level;
-    PageID maxPIDInRun;
-    unsigned appendBlockCount;
 
 public:
     virtual void run();
 
     ArchiveIndex* getIndex() { return index; }
 
-    /*
-     * Called by processFlushRequest to forcibly start a new run
-     */
-    void resetCurrentRun()
-    {
-        currentRun++;
-        maxPIDInRun = std::numeric_limits<PageID>::min();
-    }
-
-    WriterThread(std::shared_ptr<AsyncRingBuffer> writebuf, ArchiveIndex* index, unsigned level, unsigned fsyncFrequency)
+    WriterThread(std::shared_ptr<AsyncRingBufferMPMC> writebuf, std::shared_ptr<RunBarrier> barrier,
+            ArchiveIndex* index, unsigned level)
         :
-            buf(writebuf), index(index), fsyncFrequency(fsyncFrequency),
-            currentRun(0), level(level),
-            maxPIDInRun(std::numeric_limits<PageID>::min()), appendBlockCount(0)
+            buf(writebuf), barrier(barrier), index(index), level(level)
     {
     }
 
@@ -70,67 +64,176 @@ public:
  * The writer thread is controlled solely using an asynchronous ring
  * buffer. This works because the writer should keep writing as long as
  * there are blocks available -- unlike the reader thread, which must stop
- * once a certain LSN is reached.
+ * once a certain LSN is reached. With more than one writer thread, all of
+ * them consume blocks from the same ring buffer. The file offset of each
+ * block is determined here, when the block is finished, so that writers do
+ * not depend on each other except on run boundaries (see RunBarrier).
  *
- * Each generated block contains a <b>header</b>, which specifies the run
+ * Each generated block has a <b>header</b>, which specifies the run
  * number, the offset up to which valid log records are found within that
- * block, and the LSN of the last log record in the block. The run number
+ * block, and the LSN of the last log record in the block. The header is
+ * kept in the metadata area of the ring buffer rather than in the block, so
+ * that the writer can hand the block to the kernel as is. The run number
  * is used by the writer thread to write blocks to the correct run file --
  * once it changes from one block to another, it must close the currently
  * generated run file an open a new one. The LSN in the last block header
- * is then used to rename the file with the correct LSN range. (We used to
+ * is then used to rename the file with the correct LSN range. Runs may
+ * also be closed explicitly by the last block assembled for them (see
+ * finish()), so that they become visible without waiting for the next one
+ * to start. (We used to
  * control these LSN boundaries with an additional queue structure, but it
  * required too many dependencies between modules that are otherwise
  * independent)
  *
+ * Blocks of a run whose boundary is already known (see start()) also carry
+ * the run number and end LSN with which it will be closed. The writer
+ * threads use them to checkpoint the run periodically, so that an
+ * unfinished run can be resumed after a crash (see
+ * ArchiveIndex::checkpointRun). If the index holds such a run, the
+ * assembly continues it right after its valid prefix.
+ *
  * \author Caetano Sauer
  */
 class BlockAssembly {
 public:
+    /*
+     * fsyncFrequency is the number of blocks written between two
+     * fdatasync calls; if zero, the run file is only synced when the run is
+     * closed. Likewise, checkpointFrequency is the number of blocks between
+     * two run checkpoints (zero disables them).
+     */
     BlockAssembly(ArchiveIndex* index, size_t blockSize, unsigned level = 1, bool compression = true,
-            unsigned fsyncFrequency = 1);
+            unsigned fsyncFrequency = 0, unsigned writerCount = 1,
+            unsigned checkpointFrequency = 0);
     virtual ~BlockAssembly();
 
-    bool start(run_number_t run);
+    /*
+     * If the run was already cut, closeAs and cutLSN are the arguments with
+     * which it will be closed by finish().
+     */
+    bool start(run_number_t run, run_number_t closeAs = 0, lsn_t cutLSN = lsn_t::null);
     bool add(logrec_t* lr);
-    void finish();
+    /*
+     * If closeRun is given, this is the last block of the current run, which
+     * is closed by the writer thread with closeRun as its last run number
+     * and endLSN as the LSN up to which the recovery log was consumed.
+     */
+    void finish(run_number_t closeRun = 0, lsn_t endLSN = lsn_t::null);
     void shutdown();
     bool hasPendingBlocks();
 
-    void resetWriter() { writer->resetCurrentRun(); }
     size_t getBlockSize() { return blockSize; }
     PageID getCurrentMaxPID() { return maxPID; }
 
-    // methods that abstract block metadata
-    static run_number_t getRunFromBlock(const char* b);
-    static size_t getEndOfBlock(const char* b);
-    static PageID getMaxPIDFromBlock(const char* b);
+    struct BlockHeader;
+    // Block metadata is kept out of the block itself, so that blocks can be
+    // written out directly from the ring buffer
+    static const BlockHeader* getHeader(RingBufferBase* buf, const char* b);
 private:
     char* dest;
-    std::shared_ptr<AsyncRingBuffer> writebuf;
-    std::unique_ptr<WriterThread> writer;
+    std::shared_ptr<AsyncRingBufferMPMC> writebuf;
+    std::vector<std::unique_ptr<WriterThread>> writers;
+    std::shared_ptr<RunBarrier> barrier;
     ArchiveIndex* archIndex;
     const size_t blockSize;
     size_t pos;
     size_t fpos;
+    // File offset of the current block
+    size_t blockOffset;
+
+    // Sequence number of the current block
+    uint64_t blockSeq;
+    // Number of run closings requested so far
+    uint64_t epoch;
+    // Whether the last run started was closed explicitly with finish()
+    bool runClosed;
+    // Run that must be closed before the current block is written
+    run_number_t closePrev;
 
     run_number_t lastRun;
+    run_number_t cutAs;
+    lsn_t cutLSN;
     PageID currentPID;
     size_t currentPIDpos;
     size_t currentPIDfpos;
     bool enableCompression;
 
-    std::vector<std::pair<PageID, size_t>> buckets;
+    std::vector<ArchiveIndex::BlockEntry> buckets;
 
     unsigned level;
     PageID maxPID;
 public:
     struct BlockHeader {
+        // Length of valid log record data in the block
         uint32_t end;
         PageID maxPID;
         run_number_t run;
+        run_number_t closeRun;
+        lsn_t endLSN;
+        // Offset of the block in the run file
+        uint64_t offset;
+        // Position of the block in the order of assembly
+        uint64_t seq;
+        // Number of run closings that must happen before the block is written
+        uint64_t epoch;
+        run_number_t closePrev;
+        // Arguments of the eventual finish() that closes the run, if known
+        run_number_t cutAs;
+        lsn_t cutLSN;
     };
 
 };
 
+/** \brief Coordinates run boundaries among the writer threads of a
+ * BlockAssembly.
+ *
+ * Blocks of the same run may be written in any order, since each one has
+ * its own precomputed offset in the run file. However, a run can only be
+ * closed once all of its blocks are written, and blocks of the next run
+ * must wait until the new run file is open. Each run closing starts a new
+ * epoch, and a block is only written once its epoch has started. The
+ * closing itself is done by the writer which holds the block that requests
+ * it, once all blocks assembled before it (according to their sequence
+ * numbers) were written.
+ *
+ * If checkpoints are enabled, the barrier also keeps track of the longest
+ * sequence of blocks written without gaps. Every checkpointFrequency
+ * blocks, the file prefix they cover is checkpointed, as long as the
+ * boundary of the run is known.
+ */
+class RunBarrier {
+public:
+    RunBarrier(ArchiveIndex* index, unsigned level, unsigned fsyncFrequency,
+            unsigned checkpointFrequency = 0);
+
+    // Wait until the block may be written, closing the previous run if the
+    // block requests it
+    void enter(const BlockAssembly::BlockHeader& h);
+    // Register the block as written, closing its run if it requests it
+    void leave(const BlockAssembly::BlockHeader& h);
+
+private:
+    ArchiveIndex* index;
+    const unsigned level;
+    const unsigned fsyncFrequency;
+    const unsigned checkpointFrequency;
+
+    std::mutex mtx;
+    std::condition_variable cond;
+    // Number of blocks written so far
+    uint64_t written;
+    // Number of runs closed so far
+    uint64_t epoch;
+    PageID maxPIDInRun;
+
+    // Blocks written after a gap in the sequence numbers
+    std::map<uint64_t, BlockAssembly::BlockHeader> writtenAhead;
+    // All blocks with lower sequence numbers were written
+    uint64_t contiguous;
+    uint64_t sinceCheckpoint;
+
+    void closeRun(run_number_t run, lsn_t endLSN);
+    void checkpoint(const BlockAssembly::BlockHeader& h);
+};
+
 #endif
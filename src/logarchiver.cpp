@@ -6,30 +6,33 @@
 #include "stopwatch.h"
 
 #include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 using namespace std;
 
 const static int DFT_BLOCK_SIZE = 8 * 1024 * 1024;
+const static unsigned DFT_WRITER_COUNT = 4;
+const static unsigned DFT_CHECKPOINT_FREQUENCY = 16;
 
-LogArchiver::LogArchiver(const std::string& archdir, LogManager* log, bool format, bool merge)
-    : log(log), shutdownFlag(false), flushReqLSN(lsn_t::null)
+LogArchiver::LogArchiver(const std::string& archdir, LogManager* log, bool format, bool merge,
+        bool indexUnarchived, size_t workspaceSize, RunBoundaryPolicy boundaryPolicy)
+    : log(log), shutdownFlag(false), flushReqLSN(lsn_t::null), boundaryPolicy(boundaryPolicy),
+    workspaceSize(workspaceSize)
 {
     w_assert0(log);
 
-    // constexpr size_t defaultWorkspaceSize = 1600;
-    // size_t workspaceSize = 1024 * 1024 * // convert MB -> B
-    //     options.get_int_option("sm_archiver_workspace_size", defaultWorkspaceSize);
     // size_t archBlockSize = options.get_int_option("sm_archiver_block_size", DFT_BLOCK_SIZE);
     // bool compression = options.get_int_option("sm_page_img_compression", 0) > 0;
 
     // CS TODO: bring options
-    // size_t workspaceSize = 1024 * 1024 * defaultWorkspaceSize; // convert MB -> B
     size_t archBlockSize = DFT_BLOCK_SIZE;
     bool compression = false;
     size_t maxOpenFiles = 20;
 
     index = std::make_shared<ArchiveIndex>(archdir, log->get_storage(), format, maxOpenFiles);
-    nextLSN = lsn_t(index->getLastRun() + 1, 0);
+    nextLSN = index->getArchivedLSN();
     w_assert1(nextLSN.hi() > 0);
 
     constexpr bool startFromFirstLogPartition = true;
@@ -41,10 +44,42 @@ LogArchiver::LogArchiver(const std::string& archdir, LogManager* log, bool forma
         }
     }
 
+    // Resume on the next sub-partition run if the last one ended mid-partition
+    currentRun = std::max(index->getLastRun() + 1, make_run_number(nextLSN.hi(), 0));
+    currentRunStart = std::chrono::steady_clock::now();
+
+    if (indexUnarchived) {
+        unarchivedIndex = std::make_shared<UnarchivedIndex>();
+        // Records before nextLSN are in the archive index
+        unarchivedIndex->publishIndexedLSN(nextLSN);
+    }
+
     heap = make_unique<ArchiverHeapSimple>();
-    // unsigned fsyncFrequency = options.get_bool_option("sm_arch_fsync_frequency", 1);
-    unsigned fsyncFrequency = 1;
-    blkAssemb = make_unique<BlockAssembly>(index.get(), archBlockSize, 1 /*level*/, compression, fsyncFrequency);
+    spill = make_unique<ArchiverSpill>(index.get());
+    // unsigned fsyncFrequency = options.get_bool_option("sm_arch_fsync_frequency", 0);
+    // unsigned writerCount = options.get_int_option("sm_arch_writer_count", DFT_WRITER_COUNT);
+    // Runs only become visible once closed, which syncs the whole file
+    unsigned fsyncFrequency = 0;
+    unsigned writerCount = DFT_WRITER_COUNT;
+    // unsigned checkpointFrequency = options.get_int_option("sm_arch_checkpoint_frequency",
+    //         DFT_CHECKPOINT_FREQUENCY);
+    unsigned checkpointFrequency = DFT_CHECKPOINT_FREQUENCY;
+
+    // Unfinished run can only be resumed if it is the one that archiving
+    // resumes with; otherwise it is generated again from scratch
+    ArchiveIndex::RunCheckpoint ckpt;
+    if (index->getRunCheckpoint(ckpt)) {
+        if (ckpt.run == currentRun && lsn_t(ckpt.endLSN) > nextLSN) {
+            resumedRun = ckpt.run;
+            resumePID = ckpt.resumePID;
+            resumeCut = RunCut{ckpt.closeAs, lsn_t(ckpt.endLSN)};
+            DBGOUT(<< "Resuming run " << resumedRun << " from PID " << resumePID);
+        }
+        else { index->discardRunCheckpoint(); }
+    }
+
+    blkAssemb = make_unique<BlockAssembly>(index.get(), archBlockSize, 1 /*level*/, compression,
+            fsyncFrequency, writerCount, checkpointFrequency);
 
     if (merge) {
         merger = make_unique<MergerDaemon>(index);
@@ -53,6 +88,15 @@ LogArchiver::LogArchiver(const std::string& archdir, LogManager* log, bool forma
     }
 
     currPartition = log->get_storage()->get_partition(nextLSN.hi());
+
+    // Log partitions whose records are all in closed runs may be recycled
+    auto idx = index.get();
+    log->get_storage()->set_archived_partition_callback([idx] {
+        auto last = idx->getLastRun();
+        if (last == 0) { return partition_number_t(0); }
+        auto p = run_partition(last);
+        return run_sub(last) == RunSubMax ? p : p - 1;
+    });
 }
 
 /*
@@ -74,9 +118,11 @@ void LogArchiver::shutdown()
     // because threads may still be accessing the log archive here.
     // this flag indicates that reader and writer threads delivering null
     // blocks is not an error, but a termination condition
-    archiveUntil(log->durable_lsn().hi());
+    archiveUntil(make_run_number(log->durable_lsn().hi(), 0));
     DBGOUT(<< "LOG ARCHIVER SHUTDOWN STARTING");
     shutdownFlag = true;
+    log->get_storage()->set_archived_partition_callback(nullptr);
+    log->notify_durable_waiters();
     join();
     DBGOUT(<< "BLKASSEMB SHUTDOWN STARTING");
     // CS FINELINE TODO: this shutdown does not close the current run anymore, so
@@ -103,30 +149,72 @@ LogArchiver::~LogArchiver()
  * The latter simplifies the write process by not allowing records to
  * be split in the middle by block boundaries.
  */
+static bool logrecLess(const logrec_t* a, const logrec_t* b)
+{
+    if (a->pid() != b->pid()) { return a->pid() < b->pid(); }
+    return a->page_version() < b->page_version();
+}
+
+bool LogArchiver::hasRecordsOfRun(run_number_t run)
+{
+    return (heap->size() > 0 && heap->topRun() == run)
+        || (!spill->empty() && spill->getRun() == run && spill->top());
+}
+
 bool LogArchiver::selection()
 {
-    if (heap->size() == 0) {
+    // Runs that were cut and whose records were all selected already only
+    // need an empty block to be closed by the writer
+    if (!cutRuns.empty() && !hasRecordsOfRun(cutRuns.begin()->first)) {
+        auto cut = cutRuns.begin();
+        if (!blkAssemb->start(cut->first, cut->second.closeAs, cut->second.endLSN)) {
+            return false;
+        }
+        blkAssemb->finish(cut->second.closeAs, cut->second.endLSN);
+        cutRuns.erase(cut);
+        return true;
+    }
+
+    if (heap->size() == 0 && spill->empty()) {
         // if there are no elements in the heap, we have nothing to write
         // -> return and wait for next activation
         DBGTHRD(<< "Selection got empty heap -- sleeping");
         return false;
     }
 
-    run_number_t run = heap->topRun();
+    // Spilled records always belong to the oldest run in the workspace
+    run_number_t run = spill->empty() ? heap->topRun() : spill->getRun();
+    w_assert1(heap->size() == 0 || heap->topRun() >= run);
     // We may only remove records form heap that are in the selection run or beyond
     if (run > selectionRun) { return false; }
-    if (!blkAssemb->start(run)) { return false; }
+    // Blocks of a cut run tell the writers how it will be closed
+    auto cut = cutRuns.find(run);
+    bool isCut = cut != cutRuns.end();
+    if (!blkAssemb->start(run, isCut ? cut->second.closeAs : 0,
+                isCut ? cut->second.endLSN : lsn_t::null))
+    {
+        return false;
+    }
 
     DBGTHRD(<< "Producing block for selection on run " << run);
     while (true) {
-        if (heap->size() == 0 || run != heap->topRun()) {
-            break;
+        logrec_t* lr = nullptr;
+        if (heap->size() > 0 && run == heap->topRun()) {
+            lr = heap->top();
         }
+        logrec_t* spilled = spill->empty() ? nullptr : spill->top();
+        bool fromSpill = spilled && (!lr || logrecLess(spilled, lr));
+        if (fromSpill) { lr = spilled; }
+
+        if (!lr) { break; }
 
-        logrec_t* lr = heap->top();
         if (blkAssemb->add(lr)) {
             // DBGTHRD(<< "Selecting for output: " << *lr);
-            heap->pop();
+            if (fromSpill) { spill->pop(); }
+            else {
+                workspaceUsed -= lr->length();
+                heap->pop();
+            }
             // w_assert3(run != heap->topRun() ||
             //     heap->top()->pid()>= lr->pid());
         }
@@ -134,7 +222,20 @@ bool LogArchiver::selection()
             break;
         }
     }
-    blkAssemb->finish();
+
+    // Last block of a cut run closes it
+    if (isCut && !hasRecordsOfRun(run)) {
+        blkAssemb->finish(cut->second.closeAs, cut->second.endLSN);
+        cutRuns.erase(cut);
+    }
+    else {
+        blkAssemb->finish();
+    }
+
+    // Block assembly copies log records, so exhausted spills can go away
+    if (!spill->empty() && !spill->top()) {
+        spill->clear();
+    }
 
     return true;
 }
@@ -189,13 +290,21 @@ logrec_t* ArchiverHeapSimple::top()
 void LogArchiver::replacement()
 {
     while(true) {
+        // Resumed run is cut where it was cut before the crash
+        if (resumedRun > 0 && nextLSN >= resumeCut.endLSN) {
+            w_assert0(nextLSN == resumeCut.endLSN);
+            cutRun(nextLSN, run_sub(resumeCut.closeAs) == RunSubMax);
+            while (selection()) {}
+        }
         if (nextLSN >= endRoundLSN) {
             nextLSN = endRoundLSN;
             break;
         }
         if (nextLSN.hi() != currPartition->num()) {
-            selectionRun = currPartition->num();
+            cutRun(nextLSN, true /* partitionEnd */);
             currPartition = log->get_storage()->get_partition(nextLSN.hi());
+            // Make the closed run visible right away
+            while (selection()) {}
         }
 
         auto lr = log->fetch_direct(currPartition, nextLSN);
@@ -217,22 +326,211 @@ void LogArchiver::replacement()
 
         w_assert1(lr->valid_header());
         w_assert1(lsn.hi() > 0);
-        const run_number_t run = lsn.hi();
-        heap->push(lr, run);
+        if (shouldCutRun()) {
+            cutRun(lsn, false);
+            while (selection()) {}
+        }
+        const run_number_t run = currentRun;
+        w_assert1(run_partition(run) == lsn.hi());
+        currentRunBytes += lr->length();
+        if (unarchivedIndex) {
+            unarchivedIndex->add(lr->pid(), lsn, run);
+        }
 
+        // Already in the prefix of the resumed run file
+        if (run == resumedRun && lr->pid() < resumePID) { continue; }
+
+        heap->push(lr, run);
+        workspaceUsed += lr->length();
         bytesReadyForSelection += lr->length();
+
+        if (workspaceSize > 0 && workspaceUsed > workspaceSize) {
+            spillWorkspace(run);
+        }
     }
 }
 
+bool LogArchiver::shouldCutRun()
+{
+    if (currentRunBytes == 0) { return false; }
+    if (resumedRun > 0 && currentRun == resumedRun) { return false; }
+    if (boundaryPolicy.maxBytes > 0 && currentRunBytes >= boundaryPolicy.maxBytes) {
+        return true;
+    }
+    if (boundaryPolicy.maxAgeMs > 0) {
+        auto age = std::chrono::steady_clock::now() - currentRunStart;
+        return age >= std::chrono::milliseconds(boundaryPolicy.maxAgeMs);
+    }
+    return false;
+}
+
+/*
+ * Stops assigning log records to the current run, which is then closed by
+ * selection once all its records are written out. The run is closed with
+ * the given end LSN, which is where archiving resumes after a restart. At
+ * the end of a partition, the run is closed with the maximum sub-partition
+ * number, and the next run starts on the next partition. Returns whether a
+ * run was cut, which is not the case if it had no log records or if the
+ * sub-partition numbers are exhausted. A resumed run is not cut before its
+ * original end LSN.
+ */
+bool LogArchiver::cutRun(lsn_t endLSN, bool partitionEnd)
+{
+    if (resumedRun > 0 && currentRun == resumedRun) {
+        if (endLSN < resumeCut.endLSN) { return false; }
+        w_assert0(endLSN == resumeCut.endLSN);
+        resumedRun = 0;
+    }
+
+    bool cut = false;
+    if (currentRunBytes > 0 && (partitionEnd || run_sub(currentRun) + 1 < RunSubMax)) {
+        run_number_t closeAs = partitionEnd ?
+            make_run_number(run_partition(currentRun), RunSubMax) : currentRun;
+        cutRuns[currentRun] = RunCut{closeAs, endLSN};
+        selectionRun = currentRun;
+        lastCutRun = closeAs;
+        currentRun++;
+        cut = true;
+        DBGTHRD(<< "Cut run " << selectionRun << " at LSN " << endLSN);
+    }
+
+    if (partitionEnd) {
+        currentRun = make_run_number(endLSN.hi(), 0);
+    }
+
+    if (cut || partitionEnd) {
+        currentRunBytes = 0;
+        currentRunStart = std::chrono::steady_clock::now();
+    }
+
+    return cut;
+}
+
+void LogArchiver::spillWorkspace(run_number_t run)
+{
+    // Older runs are selectable, so they are written out instead of spilled
+    while (heap->size() > 0 && heap->topRun() < run) {
+        if (!selection()) { break; }
+    }
+    if (heap->size() == 0 || heap->topRun() != run) { return; }
+
+    // Spills of an older run must be consumed before spilling a new one
+    while (!spill->empty() && spill->getRun() != run) {
+        if (!selection()) { return; }
+    }
+
+    DBGTHRD(<< "Workspace full -- spilling run " << run);
+    workspaceUsed -= spill->spill(*heap, run);
+    bytesReadyForSelection = 0;
+}
+
+size_t ArchiverSpill::spill(ArchiverHeapSimple& heap, run_number_t run)
+{
+    w_assert0(empty() || this->run == run);
+    this->run = run;
+
+    Input input;
+    input.path = index->getSpillPath(run, inputs.size());
+    input.length = 0;
+    input.pos = 0;
+
+    auto& backend = index->get_backend();
+    int fd = backend->open(input.path, O_WRONLY | O_CREAT | O_TRUNC, 0744);
+    CHECK_ERRNO(fd);
+
+    writeBuffer.resize(WriteBufferSize);
+    size_t bufPos = 0;
+    auto flushBuffer = [&] {
+        auto ret = backend->write(fd, writeBuffer.data(), bufPos);
+        CHECK_ERRNO(ret);
+        w_assert0((size_t) ret == bufPos);
+        bufPos = 0;
+    };
+
+    while (heap.size() > 0 && heap.topRun() == run) {
+        logrec_t* lr = heap.top();
+        if (bufPos + lr->length() > writeBuffer.size()) { flushBuffer(); }
+        memcpy(&writeBuffer[bufPos], lr, lr->length());
+        bufPos += lr->length();
+        input.length += lr->length();
+        heap.pop();
+    }
+    flushBuffer();
+
+    auto ret = backend->close(fd);
+    CHECK_ERRNO(ret);
+
+    if (input.length == 0) {
+        backend->remove(input.path);
+        return 0;
+    }
+
+    fd = backend->open(input.path, O_RDONLY);
+    CHECK_ERRNO(fd);
+    char* data = backend->mmap(fd, input.length);
+    if (data == MAP_FAILED) { CHECK_ERRNO(-1); }
+    input.data = data;
+    ret = backend->close(fd);
+    CHECK_ERRNO(ret);
+    // Mapping outlives the file, so nothing is left behind after a crash
+    backend->remove(input.path);
+
+    inputs.push_back(input);
+    minInput = -1;
+
+    return input.length;
+}
+
+logrec_t* ArchiverSpill::top()
+{
+    if (minInput < 0) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            auto& in = inputs[i];
+            if (in.pos >= in.length) { continue; }
+            auto lr = reinterpret_cast<logrec_t*>(in.data + in.pos);
+            if (minInput < 0 || logrecLess(lr, reinterpret_cast<logrec_t*>(
+                            inputs[minInput].data + inputs[minInput].pos)))
+            {
+                minInput = i;
+            }
+        }
+        if (minInput < 0) { return nullptr; }
+    }
+
+    auto& in = inputs[minInput];
+    return reinterpret_cast<logrec_t*>(in.data + in.pos);
+}
+
+void ArchiverSpill::pop()
+{
+    w_assert1(minInput >= 0);
+    auto& in = inputs[minInput];
+    in.pos += reinterpret_cast<logrec_t*>(in.data + in.pos)->length();
+    minInput = -1;
+}
+
+void ArchiverSpill::clear()
+{
+    auto& backend = index->get_backend();
+    for (auto& in : inputs) {
+        backend->munmap(in.data, in.length);
+    }
+    inputs.clear();
+    minInput = -1;
+}
+
 void LogArchiver::run()
 {
     while(true) {
         endRoundLSN = log->durable_lsn();
         while (nextLSN == endRoundLSN) {
-            // we're going faster than log, call selection and sleep a bit (1ms)
-            selection(); // called to make sure we make progress on archiving if logging is slow or stuck
-            ::usleep(1000);
-            endRoundLSN = log->durable_lsn();
+            // we're going faster than log, call selection and wait for the
+            // log to be flushed
+            if (shouldCutRun()) { cutRun(nextLSN, false); }
+            // called to make sure we make progress on archiving if logging is
+            // slow or stuck -- one block at a time, as long as there is work
+            bool selected = selection();
+            endRoundLSN = log->wait_for_durable(nextLSN + 1, selected ? 1 : DFT_IDLE_WAIT_MS);
 
             if (shutdownFlag) { break; }
 
@@ -256,22 +554,20 @@ void LogArchiver::run()
 
         if (flushReqLSN != lsn_t::null) {
             w_assert0(endRoundLSN >= flushReqLSN);
-            // consume whole heap
-            selectionRun = currPartition->num();
+            // Close current run, so that all log records consumed so far
+            // end up in closed runs, and consume whole heap
+            if (!cutRun(nextLSN, false)) {
+                // Nothing to cut or no sub-partition numbers left -- records
+                // are written out, but the run stays open
+                selectionRun = currentRun;
+            }
             while (selection()) {}
-            // Heap empty: Wait for all blocks to be consumed and writen out
             w_assert0(heap->size() == 0);
-            while (blkAssemb->hasPendingBlocks()) {
-                ::usleep(10000); // 10ms
-            }
-
-            // Forcibly close current run to guarantee that LSN is persisted
-            PageID maxPID = blkAssemb->getCurrentMaxPID();
-            index->closeCurrentRun(flushReqLSN.hi(), 1 /* level */, maxPID);
-            // blkAssemb->resetWriter();
 
-            // CS FINELINE TODO: must guarantee that flushReqLSN.hi() will not
-            // be appended to anymore!
+            // Wait for the writer to close the runs
+            while (index->getLastRun() < lastCutRun) {
+                index->waitForRun(lastCutRun);
+            }
 
             /* Now we know that the requested LSN has been processed by the
              * heap and all archiver temporary memory has been flushed. Thus,
@@ -280,6 +576,15 @@ void LogArchiver::run()
              */
             flushReqLSN = lsn_t::null;
             lintel::atomic_thread_fence(lintel::memory_order_release);
+            flushesDone.publish(flushesDone.get() + 1);
+        }
+
+        consumedLSN.publish(nextLSN.data());
+
+        // Records of runs already closed can be found in the archive index
+        if (unarchivedIndex) {
+            unarchivedIndex->publishIndexedLSN(nextLSN);
+            unarchivedIndex->truncate(index->getLastRun());
         }
 
         /*
@@ -301,7 +606,7 @@ void LogArchiver::run()
     // Perform selection until all remaining entries are flushed out of
     // the heap into runs. Last run boundary is also enqueued.
     DBGOUT(<< "Archiver exiting -- last round of selection to empty heap");
-    selectionRun = currPartition->num();
+    if (!cutRun(nextLSN, false)) { selectionRun = currentRun; }
     while (selection()) {}
     DBGOUT(<< "Archiver done!");
 
@@ -325,6 +630,8 @@ bool LogArchiver::requestFlushAsync(lsn_t reqLSN)
     if (flushReqLSN != reqLSN) {
         return false;
     }
+    // Wake up archiver if it is waiting for the log
+    log->notify_durable_waiters();
     return true;
 }
 
@@ -332,19 +639,23 @@ void LogArchiver::requestFlushSync(lsn_t reqLSN)
 {
     log->flush(reqLSN);
     DBGTHRD(<< "Requesting flush until LSN " << reqLSN);
-    while (!requestFlushAsync(reqLSN)) {
-        usleep(1000); // 1ms
+    while (true) {
+        // Pending request of another thread must be done before ours
+        auto done = flushesDone.get();
+        if (requestFlushAsync(reqLSN)) { break; }
+        flushesDone.waitFor(done + 1);
     }
     // When log archiver is done processing the flush request, it will set
     // flushReqLSN back to null. This method only guarantees that the flush
     // request was processed. The caller must still wait for the desired run to
     // be persisted -- if it so wishes.
     while(true) {
+        auto done = flushesDone.get();
         lintel::atomic_thread_fence(lintel::memory_order_acquire);
         if (flushReqLSN == lsn_t::null) {
             break;
         }
-        ::usleep(10000); // 10ms
+        flushesDone.waitFor(done + 1);
     }
 }
 
@@ -356,7 +667,7 @@ void LogArchiver::archiveUntil(run_number_t run)
 
     // wait for log record to be consumed
     while (nextLSN < until) {
-        ::usleep(10000); // 10ms
+        consumedLSN.waitFor(until.data());
     }
 
     if (index->getLastRun() < run) {
@@ -364,19 +675,20 @@ void LogArchiver::archiveUntil(run_number_t run)
     }
 }
 
-MergerDaemon::MergerDaemon(std::shared_ptr<ArchiveIndex> in, std::shared_ptr<ArchiveIndex> out)
+MergerDaemon::MergerDaemon(std::shared_ptr<ArchiveIndex> in, std::shared_ptr<ArchiveIndex> out,
+        std::unique_ptr<LogCompactor> compactor, bool compression)
     :
     // CS TODO: interval should come from merge policy
     worker_thread_t(0),
-     indir(in), outdir(out)
+     indir(in), outdir(out), _compression(compression),
+     _compactor(std::move(compactor))
 {
     // CS TODO: options
     // _fanin = options.get_int_option("sm_archiver_fanin", 5);
-    // _compression = options.get_int_option("sm_page_img_compression", 0) > 0;
     // _blockSize = options.get_int_option("sm_archiver_block_size", DFT_BLOCK_SIZE);
     _fanin = 5;
-    _compression = false;
     _blockSize = DFT_BLOCK_SIZE;
+    if (_compactor) { _imgLogrec.reset(new logrec_t); }
     if (!outdir) { outdir = indir; }
     w_assert0(indir && outdir);
 }
@@ -387,6 +699,57 @@ void MergerDaemon::do_work()
     doMerge(1, _fanin);
 }
 
+void MergerDaemon::addToRun(BlockAssembly& blkAssemb, logrec_t* lr, run_number_t run)
+{
+    if (!blkAssemb.add(lr)) {
+        blkAssemb.finish();
+        blkAssemb.start(run);
+        blkAssemb.add(lr);
+    }
+}
+
+void MergerDaemon::flushChain(BlockAssembly& blkAssemb, run_number_t run)
+{
+    if (_chain.empty()) { return; }
+
+    // Records before the last page image are superseded by it
+    size_t img = 0;
+    for (size_t i = _chain.size(); i > 0; i--) {
+        if (_chain[i-1]->has_page_img()) { img = i-1; break; }
+    }
+
+    size_t count = _chain.size() - img;
+    size_t bytes = 0;
+    for (size_t i = img; i < _chain.size(); i++) {
+        bytes += _chain[i]->length();
+    }
+
+    // Chains without a page image build on older runs, so they are copied
+    if (count > 1 && _chain[img]->has_page_img()
+            && _compactor->exceedsThreshold(bytes, count)
+            && _compactor->compact(&_chain[img], count, _imgLogrec.get()))
+    {
+        w_assert1(_imgLogrec->has_page_img());
+        w_assert1(_imgLogrec->pid() == _chain.back()->pid());
+        w_assert1(_imgLogrec->page_version() == _chain.back()->page_version());
+        addToRun(blkAssemb, _imgLogrec.get(), run);
+    }
+    else {
+        for (size_t i = img; i < _chain.size(); i++) {
+            addToRun(blkAssemb, _chain[i], run);
+        }
+    }
+
+    _chain.clear();
+}
+
+void MergerDaemon::waitForNewRun()
+{
+    // Timeout bounds the time it takes to notice a stop request
+    constexpr long timeoutMs = 1000;
+    indir->waitForRun(indir->getLastRun() + 1, timeoutMs);
+}
+
 bool runComp(const RunId& a, const RunId& b)
 {
     return a.begin < b.begin;
@@ -401,7 +764,7 @@ void MergerDaemon::doMerge(unsigned level, unsigned fanin)
     if (stats.size() < fanin) {
         // CS TODO: merge policies
         DBGOUT3(<< "Not enough runs to merge: " << stats.size());
-        ::sleep(1);
+        waitForNewRun();
         return;
     }
 
@@ -427,7 +790,7 @@ void MergerDaemon::doMerge(unsigned level, unsigned fanin)
     if (count < fanin) {
         // CS TODO: merge policies
         DBGOUT3(<< "Not enough runs to merge");
-        ::sleep(1);
+        waitForNewRun();
         return;
     }
 
@@ -442,13 +805,21 @@ void MergerDaemon::doMerge(unsigned level, unsigned fanin)
             logrec_t* lr;
             blkAssemb.start(runNumber);
             while (scan.next(lr)) {
-                if (!blkAssemb.add(lr)) {
-                    blkAssemb.finish();
-                    blkAssemb.start(runNumber);
-                    blkAssemb.add(lr);
+                if (!_compactor) {
+                    addToRun(blkAssemb, lr, runNumber);
+                    continue;
+                }
+
+                // Collect the history of each PID, which is compacted if
+                // it gets too long (log records remain mapped during the scan)
+                if (!_chain.empty() && _chain.back()->pid() != lr->pid()) {
+                    flushChain(blkAssemb, runNumber);
                 }
+                _chain.push_back(lr);
             }
-            blkAssemb.finish();
+            flushChain(blkAssemb, runNumber);
+            // Merged run covers the same run numbers as its inputs
+            blkAssemb.finish(std::prev(end)->end);
         }
 
         blkAssemb.shutdown();
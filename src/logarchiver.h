@@ -5,8 +5,13 @@
 #include "logarchive_index.h"
 #include "logarchive_writer.h"
 #include "w_heap.h"
+#include "unarchived_index.h"
 #include "log_storage.h"
+#include "logrec.h"
 
+#include <chrono>
+#include <map>
+#include <memory>
 #include <queue>
 #include <set>
 
@@ -17,6 +22,78 @@ namespace fs = boost::filesystem;
 class LogManager;
 class LogScanner;
 
+/**
+ * Replaces the history of a page with a single page-image log record. Used by
+ * MergerDaemon to compact the log archive while merging runs: once the
+ * history of a page since its last page image in the merged output exceeds
+ * the given thresholds (in bytes or number of log records), it is replaced by
+ * the result of compact(). Histories without a page image are never
+ * compacted, because the rest of the page's history is in older runs.
+ */
+class LogCompactor
+{
+public:
+    LogCompactor(size_t maxBytes = DFT_MAX_BYTES, size_t maxLogrecs = DFT_MAX_LOGRECS)
+        : maxBytes(maxBytes), maxLogrecs(maxLogrecs)
+    {}
+
+    virtual ~LogCompactor() {}
+
+    bool exceedsThreshold(size_t bytes, size_t logrecs) const
+    {
+        return bytes > maxBytes || logrecs > maxLogrecs;
+    }
+
+    /*
+     * Replays the given chain of log records of a single page, which is sorted
+     * by page version, and writes into out a page-image log record with the
+     * version of the last one. Only the first record is a page image. Returns
+     * false if the chain cannot be compacted, in which case it is copied
+     * unchanged.
+     */
+    virtual bool compact(logrec_t** chain, size_t count, logrec_t* out) = 0;
+
+    const static size_t DFT_MAX_BYTES = 64 * 1024;
+    const static size_t DFT_MAX_LOGRECS = 256;
+
+private:
+    const size_t maxBytes;
+    const size_t maxLogrecs;
+};
+
+/*
+ * LogCompactor that replays the chain with a Redoer (as in NodeFetch) on a
+ * node created by a user-supplied PageFactory, which must provide:
+ * - Node* allocate(PageID pid): returns an empty node for the given page
+ * - bool make_image(Node* node, logrec_t* out): writes a page-image log record
+ *   of the node into out
+ * - void release(Node* node)
+ */
+template <typename Redoer, typename PageFactory>
+class RedoCompactor : public LogCompactor
+{
+public:
+    RedoCompactor(PageFactory& factory, size_t maxBytes = DFT_MAX_BYTES,
+            size_t maxLogrecs = DFT_MAX_LOGRECS)
+        : LogCompactor(maxBytes, maxLogrecs), factory(factory)
+    {}
+
+    virtual bool compact(logrec_t** chain, size_t count, logrec_t* out)
+    {
+        w_assert1(count > 0 && chain[0]->has_page_img());
+        auto node = factory.allocate(chain[0]->pid());
+        for (size_t i = 0; i < count; i++) {
+            Redoer::redo(chain[i], node);
+        }
+        bool success = factory.make_image(node, out);
+        factory.release(node);
+        return success;
+    }
+
+private:
+    PageFactory& factory;
+};
+
 /**
  * Version of ArchiverHeap that does not use an internal memory manager, instead storing the given
  * logrec_t pointers directly. Works very well if the log is scanned with mmap.
@@ -69,6 +146,51 @@ private:
     Heap<HeapEntry, HeapEntry::Cmp> w_heap;
 };
 
+/**
+ * Sorted sub-runs spilled to temporary files by the log archiver when the
+ * heap exceeds its workspace budget. Since run numbers are log partition
+ * numbers, a single run may otherwise hold all log records of a whole
+ * partition in the heap. Spilled records are merged with the remaining heap
+ * entries of the same run during selection, so the archive still gets a
+ * single level-1 run per partition. All spills belong to the same run.
+ */
+class ArchiverSpill
+{
+public:
+    ArchiverSpill(ArchiveIndex* index) : index(index), run(0), minInput(-1) {}
+    ~ArchiverSpill() { clear(); }
+
+    // Moves all heap entries of the given run into a new spill file and
+    // returns the number of log record bytes spilled
+    size_t spill(ArchiverHeapSimple& heap, run_number_t run);
+
+    bool empty() const { return inputs.empty(); }
+    run_number_t getRun() const { return run; }
+
+    // Smallest spilled record not yet selected (nullptr if all were)
+    logrec_t* top();
+    void pop();
+
+    // Unmaps and deletes all spill files
+    void clear();
+
+private:
+    struct Input {
+        std::string path;
+        char* data;
+        size_t length;
+        size_t pos;
+    };
+
+    ArchiveIndex* index;
+    run_number_t run;
+    std::vector<Input> inputs;
+    int minInput;
+    std::vector<char> writeBuffer;
+
+    const static size_t WriteBufferSize = 1024 * 1024;
+};
+
 /**
  * Basic service to merge existing log archive runs into larger ones.
  * Currently, the merge logic only supports the *very limited* use case of
@@ -86,11 +208,18 @@ private:
  * startLSN coming from the existing run files, etc. We have to make that
  * logic clever and more abstract; or simply don't reuse the BlockAssembly
  * infrastructure.
+ *
+ * If a LogCompactor is given, the records of each page that precede its last
+ * page image are dropped during the merge, and long histories since that
+ * image are replaced by a single page-image log record synthesized by the
+ * compactor, so that higher levels hold bounded per-page histories.
  */
 class MergerDaemon : public worker_thread_t {
 public:
     MergerDaemon(std::shared_ptr<ArchiveIndex> in,
-        std::shared_ptr<ArchiveIndex> ou = nullptr);
+        std::shared_ptr<ArchiveIndex> ou = nullptr,
+        std::unique_ptr<LogCompactor> compactor = nullptr,
+        bool compression = false);
 
     virtual ~MergerDaemon() {}
 
@@ -104,6 +233,30 @@ private:
     unsigned _fanin;
     bool _compression;
     size_t _blockSize;
+    std::unique_ptr<LogCompactor> _compactor;
+
+    // History of the current PID during a merge (used for compaction only)
+    std::vector<logrec_t*> _chain;
+    std::unique_ptr<logrec_t> _imgLogrec;
+
+    void waitForNewRun();
+    void addToRun(BlockAssembly& blkAssemb, logrec_t* lr, run_number_t run);
+    void flushChain(BlockAssembly& blkAssemb, run_number_t run);
+};
+
+/*
+ * Controls when the log archiver closes a run before its log partition ends.
+ * A record only becomes visible in the archive index once its run is closed,
+ * so this bounds how stale the archive can be regardless of the partition
+ * size. Zero disables the corresponding criterion.
+ */
+struct RunBoundaryPolicy
+{
+    // Close run once this many bytes of redo log records were assigned to it
+    size_t maxBytes = 0;
+    // Close run once its first log record was consumed this long ago, i.e.,
+    // the freshness target of the log archive
+    unsigned maxAgeMs = 0;
 };
 
 /** \brief Implementation of a log archiver using asynchronous reader and
@@ -171,7 +324,9 @@ private:
  */
 class LogArchiver : public thread_wrapper_t {
 public:
-    LogArchiver(const std::string& archdir, LogManager* log, bool format, bool merge);
+    LogArchiver(const std::string& archdir, LogManager* log, bool format, bool merge,
+            bool indexUnarchived = false, size_t workspaceSize = DFT_WORKSPACE_SIZE,
+            RunBoundaryPolicy boundaryPolicy = RunBoundaryPolicy());
     virtual ~LogArchiver();
 
     virtual void run();
@@ -182,6 +337,7 @@ public:
     void archiveUntil(run_number_t);
 
     std::shared_ptr<ArchiveIndex> getIndex() { return index; }
+    std::shared_ptr<UnarchivedIndex> getUnarchivedIndex() { return unarchivedIndex; }
     lsn_t getNextConsumedLSN() { return nextLSN; }
 
     /*
@@ -191,24 +347,64 @@ public:
     const static bool DFT_EAGER = true;
     const static bool DFT_READ_WHOLE_BLOCKS = true;
     const static int DFT_GRACE_PERIOD = 1000000; // 1 sec
+    // Maximum volume of log records referenced by the heap before spilling
+    // (0 = unbounded)
+    const static size_t DFT_WORKSPACE_SIZE = 1600ul * 1024 * 1024;
+    // Maximum time the archiver waits for the log without doing anything
+    // (bounds latency of time-based run boundaries)
+    const static long DFT_IDLE_WAIT_MS = 100;
 
 private:
     LogManager* log;
     std::shared_ptr<ArchiveIndex> index;
+    std::shared_ptr<UnarchivedIndex> unarchivedIndex;
     std::unique_ptr<ArchiverHeapSimple> heap;
+    std::unique_ptr<ArchiverSpill> spill;
     std::unique_ptr<BlockAssembly> blkAssemb;
     std::unique_ptr<MergerDaemon> merger;
 
     std::atomic<bool> shutdownFlag;
     lsn_t flushReqLSN;
     lsn_t nextLSN;
+    // Incremented every time a flush request is done
+    SeqNotifier flushesDone;
+    // Published with nextLSN at the end of each activation
+    SeqNotifier consumedLSN;
     lsn_t endRoundLSN;
     std::shared_ptr<partition_t> currPartition;
     run_number_t selectionRun = 0;
+
+    // Run assigned to incoming log records
+    run_number_t currentRun;
+    size_t currentRunBytes = 0;
+    std::chrono::steady_clock::time_point currentRunStart;
+    RunBoundaryPolicy boundaryPolicy;
+
+    // Runs that no longer receive log records but were not closed yet,
+    // along with the run number and end LSN with which they are closed
+    struct RunCut {
+        run_number_t closeAs;
+        lsn_t endLSN;
+    };
+    std::map<run_number_t, RunCut> cutRuns;
+    run_number_t lastCutRun = 0;
+
+    // Unfinished run resumed from a checkpoint (see BlockAssembly): log
+    // records of PIDs lower than resumePID are already in its file, and
+    // the run must be cut exactly at resumeCut.endLSN
+    run_number_t resumedRun = 0;
+    PageID resumePID = 0;
+    RunCut resumeCut;
     size_t bytesReadyForSelection = 0;
+    size_t workspaceSize;
+    size_t workspaceUsed = 0;
 
     void replacement();
     bool selection();
+    void spillWorkspace(run_number_t run);
+    bool shouldCutRun();
+    bool cutRun(lsn_t endLSN, bool partitionEnd);
+    bool hasRecordsOfRun(run_number_t run);
 
 };
 
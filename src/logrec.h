@@ -58,6 +58,7 @@ Rome Research Laboratory Contract No. F30602-97-2-0247.
 #define FINELOG_LOGREC_H
 
 #include <array>
+#include <cstddef>
 #include <limits>
 #include <cstring>
 #include <cstdlib>
@@ -65,6 +66,7 @@ Rome Research Laboratory Contract No. F30602-97-2-0247.
 
 #include "finelog_basics.h"
 #include "lsn.h"
+#include "crc32c.h"
 
 // 1/4 of typical cache-line size (64B)
 constexpr size_t LogrecAlignment = 16;
@@ -76,6 +78,9 @@ struct alignas(LogrecAlignment) baseLogHeader
    uint32_t _page_version;
    uint16_t _len;
    uint8_t _type;
+   // CRC-32C of the log record, set when it is inserted into the recovery
+   // log (see logrec_t::set_checksum); occupies what used to be padding
+   uint32_t _checksum;
 
    bool is_valid() const;
 };
@@ -201,6 +206,30 @@ public:
         header._page_version = version;
     }
 
+    /*
+     * Checksum over the whole log record except the checksum field itself.
+     * The recovery log uses the partition number as seed, so that records
+     * left over in a recycled partition file are not taken as valid.
+     */
+    uint32_t compute_checksum(uint32_t seed) const
+    {
+        constexpr size_t before = offsetof(baseLogHeader, _checksum);
+        auto p = reinterpret_cast<const char*>(this);
+        auto crc = crc32c(seed, p, before);
+        return crc32c(crc, p + sizeof(baseLogHeader), length() - sizeof(baseLogHeader));
+    }
+
+    void set_checksum(uint32_t seed)
+    {
+        header._checksum = compute_checksum(seed);
+    }
+
+    // Header must be valid, so that the length can be trusted
+    bool valid_checksum(uint32_t seed) const
+    {
+        return header._checksum == compute_checksum(seed);
+    }
+
     uint8_t get_flags() const
     {
         return flags[type()];
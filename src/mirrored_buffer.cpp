@@ -0,0 +1,60 @@
+#include "mirrored_buffer.h"
+
+#include "finelog_basics.h"
+
+#include <cerrno>
+#include <sys/mman.h>
+#include <unistd.h>
+
+bool MirroredBuffer::isValidSize(size_t size)
+{
+    auto pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return size > 0 && size % pageSize == 0;
+}
+
+MirroredBuffer::MirroredBuffer(size_t size)
+    : _data(nullptr), _size(size)
+{
+    if (!isValidSize(size)) {
+        throw std::runtime_error("Mirrored buffer size must be a multiple of the page size");
+    }
+
+    int fd = ::memfd_create("finelog_mirror", MFD_CLOEXEC);
+    CHECK_ERRNO(fd);
+    auto ret = ::ftruncate(fd, size);
+    CHECK_ERRNO(ret);
+
+    // Reserve address space for both mappings, then map the file twice on top
+    void* addr = ::mmap(nullptr, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        int err = errno;
+        ::close(fd);
+        errno = err;
+        CHECK_ERRNO(-1);
+    }
+    char* base = static_cast<char*>(addr);
+
+    for (int i = 0; i < 2; i++) {
+        void* m = ::mmap(base + i * size, size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+        if (m == MAP_FAILED) {
+            int err = errno;
+            ::munmap(base, 2 * size);
+            ::close(fd);
+            errno = err;
+            CHECK_ERRNO(-1);
+        }
+    }
+
+    // Mappings keep the file alive
+    ret = ::close(fd);
+    CHECK_ERRNO(ret);
+    _data = base;
+}
+
+MirroredBuffer::~MirroredBuffer()
+{
+    if (_data) {
+        ::munmap(_data, 2 * _size);
+    }
+}
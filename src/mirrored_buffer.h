@@ -0,0 +1,34 @@
+#ifndef FINELOG_MIRRORED_BUFFER_H
+#define FINELOG_MIRRORED_BUFFER_H
+
+#include <cstddef>
+
+/** \brief Memory buffer mapped twice into adjacent virtual addresses.
+ *
+ * The same physical pages (of an anonymous memfd file) are mapped at
+ * data() and at data() + size(), so that any range of up to size() bytes
+ * starting within the buffer is contiguous in virtual memory, even if it
+ * wraps around the end. This allows circular buffers to hand out pointers
+ * to items that cross the wrap-around point without copying them.
+ *
+ * The size must be a multiple of the page size (see isValidSize).
+ */
+class MirroredBuffer {
+public:
+    MirroredBuffer(size_t size);
+    ~MirroredBuffer();
+
+    MirroredBuffer(const MirroredBuffer&) = delete;
+    MirroredBuffer& operator=(const MirroredBuffer&) = delete;
+
+    char* data() { return _data; }
+    size_t size() const { return _size; }
+
+    static bool isValidSize(size_t size);
+
+private:
+    char* _data;
+    size_t _size;
+};
+
+#endif
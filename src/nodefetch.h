@@ -1,90 +1,171 @@
 #pragma once
 //--------------------------------------------------------------------------------
+#include <algorithm>
+#include <array>
 #include <memory>
+#include <type_traits>
+#include <vector>
 #include "logarchive_scanner.h"
+#include "unarchived_index.h"
+#include "log.h"
 //--------------------------------------------------------------------------------
 /*
  * A log-record iterator that encapsulates a log archive scan and a recovery
  * log scan. It reads from the former until it runs out, after which it reads
  * from the latter, which is collected by following the per-page chain in the
  * recovery log.
+ *
+ * If an UnarchivedIndex is given, the recovery log part is collected from it
+ * instead: these are the records consumed by the log archiver but whose run
+ * was not closed yet. Before looking up the index, NodeFetch waits for the
+ * archiver to consume all durable records, so that the newest updates of a
+ * page are not missed if it is fetched again right after being evicted. If
+ * the archiver closes a run between probing the archive and looking up the
+ * index, the archive is probed again for the new runs.
+ *
+ * Log records are delivered to the Redoer in batches of consecutive records
+ * of the same run. If Redoer provides a static
+ * redo_batch(logrec_t** lrs, size_t count, Node* node), it receives each batch
+ * in a single call; otherwise, redo(lr, node) is invoked for each record.
  */
 template <typename Redoer>
 class NodeFetch
 {
 public:
    NodeFetch(std::shared_ptr<ArchiveIndex> archIndex)
-      : archive_scan{archIndex}, img_consumed{false}
+      : archive_scan{archIndex}, log{nullptr}
    {
    }
 
+   NodeFetch(std::shared_ptr<ArchiveIndex> archIndex, LogManager* log,
+         std::shared_ptr<UnarchivedIndex> unarchived)
+      : archive_scan{archIndex}, log{log},
+      unarchived{unarchived}
+   {
+       w_assert0(!unarchived || log);
+   }
+
    ~NodeFetch() = default;
 
    template <typename NodeID>
    void open(NodeID id)
    {
        archive_scan.open(id, id+1);
-       img_consumed = false;
+       filter.reset();
+       pid = id;
    }
 
    template <typename Node>
    void apply(Node& node)
    {
-       logrec_t* lr;
-       unsigned replayed = 0; // used for debugging
+       applyArchived(node);
+
+       if (!unarchived) { return; }
+
+       // Durable records which the archiver did not consume yet are not in
+       // the index (e.g., updates of a page that was just evicted)
+       auto durable = log->durable_lsn();
+       while (unarchived->getIndexedLSN() < durable) {
+           unarchived->waitForIndexedLSN(durable);
+       }
 
-       while (archive_scan.next(lr)) {
-           redo(node, lr);
-           replayed++;
+       lsns.clear();
+       while (!unarchived->collect(pid, getLastProbedRun(), lsns)) {
+           // Runs were closed in the meantime -- fetch them from the archive
+           reopen(pid);
+           applyArchived(node);
        }
+
+       applyUnarchived(node);
    }
 
    // Required for eviction of pages with updates not yet archived (FineLine)
    template <typename NodeID>
    void reopen(NodeID id)
    {
-       archive_scan.open(id, id+1, getLastProbedRun()+1);
+       archive_scan.reopen(id, id+1);
+       pid = id;
    }
 
    run_number_t getLastProbedRun() const { return archive_scan.getLastProbedRun(); }
 
 private:
 
-   bool shouldRedo(const logrec_t* lr)
+   template <typename Node>
+   void applyArchived(Node& node)
+   {
+       unsigned replayed = 0; // used for debugging
+
+       while (size_t count = archive_scan.nextBatch(batch.data(), batch.size())) {
+           redo(node, batch.data(), count);
+           replayed += count;
+       }
+   }
+
+   template <typename Node>
+   void applyUnarchived(Node& node)
    {
-       assert(lr->valid_header());
-       assert(lr->is_redo());
-       assert(lr->page_version() > 0);
-       // TODO: only assert this if Node type is actually a page
-       // assert(p.pid() == lr->pid());
-       // assert(lr->has_page_img() || p.version() > 0);
-       // assert(p.version() < lr->page_version());
-
-       // This is a hack to circumvent a problem with page-img compression. Since it is an SSX,
-       // it may appear in the log before a page update with lower version. Usually, that's not a
-       // problem, because the updates will be ordered by version when scanning. But, in the
-       // special case where the lower update ends up in the next log file, it will not be
-       // eliminated by page-img compression, and thus NodeFetch will not see the page image
-       // as the first log record. This is fixed with the check below.
-       if (lr->has_page_img()) {
-           img_consumed = true;
+       // Partitions are kept open while the fetched log records are used
+       std::vector<std::shared_ptr<partition_t>> partitions;
+       logrecs.clear();
+
+       for (auto lsn : lsns) {
+           if (partitions.empty() || partitions.back()->num() != lsn.hi()) {
+               partitions.push_back(log->get_storage()->get_partition(lsn.hi()));
+               w_assert0(partitions.back());
+           }
+           logrecs.push_back(log->fetch_direct(partitions.back(), lsn));
        }
-       else if (!img_consumed) {
-           return false;
+
+       // Same order in which log records are replayed from the archive
+       std::stable_sort(logrecs.begin(), logrecs.end(),
+               [](const logrec_t* a, const logrec_t* b) {
+                   return a->page_version() < b->page_version();
+               });
+
+       if (!logrecs.empty()) {
+           redo(node, logrecs.data(), logrecs.size());
        }
-       return true;
    }
 
+   template <typename R, typename Node, typename = void>
+   struct has_redo_batch : std::false_type {};
+
+   template <typename R, typename Node>
+   struct has_redo_batch<R, Node, std::void_t<decltype(R::redo_batch(
+           std::declval<logrec_t**>(), size_t{}, std::declval<Node*>()))>>
+       : std::true_type {};
+
    template <typename Node>
-   void redo(Node& node, logrec_t* lr)
+   void redo(Node& node, logrec_t** lrs, size_t count)
    {
-       if (!shouldRedo(lr)) {
-          return;
+       // Filter in place the records that must not be replayed
+       size_t n = 0;
+       for (size_t i = 0; i < count; i++) {
+           if (filter.shouldRedo(lrs[i])) { lrs[n++] = lrs[i]; }
+       }
+       if (n == 0) { return; }
+
+       if constexpr (has_redo_batch<Redoer, Node>::value) {
+           Redoer::redo_batch(lrs, n, &node);
+       }
+       else {
+           for (size_t i = 0; i < n; i++) {
+               Redoer::redo(lrs[i], &node);
+           }
        }
-       Redoer::redo(lr, &node);
    }
 
    ArchiveScan archive_scan;
-   bool img_consumed; // Workaround for page-img compression (see comments in cpp)
+   ReplayFilter filter; // Workaround for page-img compression
+
+   static constexpr size_t BatchSize = 64;
+   std::array<logrec_t*, BatchSize> batch;
+
+   LogManager* log;
+   std::shared_ptr<UnarchivedIndex> unarchived;
+   PageID pid;
+   std::vector<lsn_t> lsns;
+   std::vector<logrec_t*> logrecs;
 };
 //--------------------------------------------------------------------------------
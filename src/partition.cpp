@@ -63,13 +63,20 @@ Rome Research Laboratory Contract No. F30602-97-2-0247.
 #include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/time.h> // gettimeofday
+
+#include <thread>
+#include <vector>
 
 using namespace std;
 
+// MAX_SCAN_THREADS = options.get_int_option("sm_log_scan_threads", 8);
+const static unsigned MAX_SCAN_THREADS = 8;
+// Partitions smaller than this are scanned by a single thread
+const static long MIN_PARALLEL_SCAN = 4 * 1024 * 1024;
+
 partition_t::partition_t(log_storage *owner, partition_number_t num)
     : _num(num), _owner(owner),
-      _fhdl(invalid_fhdl), _delete_after_close(false), _skip_logrec{logrec_t::get_eof_logrec().type()}
+      _fhdl(invalid_fhdl), _delete_after_close(false), _recycle_after_close(false), _staged(false), _last_access(0), _skip_logrec{logrec_t::get_eof_logrec().type()}
 {
     // Add space for skip log record
     _max_partition_size = owner->get_partition_size() + sizeof(baseLogHeader);
@@ -87,7 +94,8 @@ long ceil2(long offset, long block_size)
 // block to be cleared upon first use.
 class block_of_zeroes {
 private:
-    char _block[log_storage::BLOCK_SIZE];
+    // Aligned for direct I/O
+    alignas(log_storage::BLOCK_SIZE) char _block[log_storage::BLOCK_SIZE];
 public:
     block_of_zeroes() {
         memset(&_block[0], 0, log_storage::BLOCK_SIZE);
@@ -104,11 +112,23 @@ char *block_of_zeros() {
 /*
  * partition::flush(int fd, bool force)
  * flush to disk whatever's been buffered.
- * Do this with a writev of 4 parts:
- * start->end1 where start is start1 rounded down to the beginning of a BLOCK
+ * Do this with a writev of 3 parts:
+ * start->end1 where start is start1, rounded down to the beginning of an
+ * I/O unit if the tail policy says so (see log_storage::tail_policy_t)
  * start2->end2
  * a skip record
- * enough zeroes to make the entire write become a multiple of BLOCK_SIZE
+ * The write used to be padded with zeroes up to a multiple of BLOCK_SIZE, so
+ * that nothing after the skip record could be mistaken for log records.
+ * Since every log record carries a checksum (see find_end), whatever
+ * follows the skip record is harmless and the last block is written
+ * partially.
+ *
+ * With direct I/O, the write must end at an I/O unit boundary too, but the
+ * bytes following the flushed ones in the log buffer may be changed by
+ * concurrent inserts. So the last, partial unit is copied into a separate
+ * aligned buffer (see log_storage::_bounce_buf), followed by the skip record
+ * and zeroes; these zeroes are overwritten by the next flush, which starts
+ * at the same unit.
  */
 void partition_t::flush(
         lsn_t lsn,  // needed so that we can set the lsn in the skip_log record
@@ -123,6 +143,9 @@ void partition_t::flush(
     long size = (end2 - start2) + (end1 - start1);
     long write_size = size;
     long file_offset;
+    const bool direct = _owner->get_direct_io();
+    const long io_unit = _owner->get_io_unit();
+    auto& backend = _owner->get_backend();
 
     { // sync log: Seek the file to the right place.
         DBG5( << "Sync-ing log lsn " << lsn
@@ -131,9 +154,13 @@ void partition_t::flush(
                 << " start2 " << start2
                 << " end2 " << end2 );
 
-        // works because BLOCK_SIZE is always a power of 2
-        file_offset = floor2(lsn.lo(), log_storage::BLOCK_SIZE);
-        // offset is rounded down to a block_size
+        // works because the I/O unit is always a power of 2
+        if (_owner->get_tail_policy() == log_storage::t_rewrite_unit) {
+            file_offset = floor2(lsn.lo(), io_unit);
+        }
+        else {
+            file_offset = lsn.lo();
+        }
 
         long delta = lsn.lo() - file_offset;
 
@@ -142,33 +169,52 @@ void partition_t::flush(
                                     // but works for unsigned...
         write_size += delta; // account for the extra (clean) bytes
         start1 -= delta;
-
-        /* FRJ: This seek is safe (in theory) because only one thread
-           can flush at a time and all other accesses to the file use
-           pread/pwrite (which doesn't change the file pointer).
-         */
-        auto ret = lseek(_fhdl, file_offset, SEEK_SET);
-        CHECK_ERRNO(ret);
     } // end sync log
 
     { // Copy a skip record to the end of the buffer.
         // CS TODO FINELINE: fix log priming
         // _skip_logrec.set_lsn_ck(lsn+size);
 
-        // Hopefully the OS is smart enough to coalesce the writes
-        // before sending them to disk. If not, and it's a problem
-        // (e.g. for direct I/O), the alternative is to assemble the last
-        // block by copying data out of the buffer so we can append the
-        // skiplog without messing up concurrent inserts. However, that
-        // could mean copying up to BLOCK_SIZE bytes.
+        // Skip log record marks the end of the log (see find_end)
+        _skip_logrec.set_checksum(_num);
+
+        struct iovec iov[] = {
+            // iovec_t expects void* not const void *
+            { (char*)buf+start1,                static_cast<size_t>(end1-start1) },
+            // iovec_t expects void* not const void *
+            { (char*)buf+start2,                static_cast<size_t>(end2-start2) },
+            { &_skip_logrec,                    _skip_logrec.length()},
+        };
         long total = write_size + _skip_logrec.length();
 
-        // works because BLOCK_SIZE is always a power of 2
-        long grand_total = ceil2(total, log_storage::BLOCK_SIZE);
-        // take it up to multiple of block size
-        w_assert2(grand_total % log_storage::BLOCK_SIZE == 0);
+        if (direct) {
+            // Log buffer offsets are congruent to partition offsets modulo
+            // the I/O unit, so the first part starts aligned. The second
+            // part either follows the first one in the buffer, or the first
+            // one ends at the end of the buffer (i.e., an aligned offset).
+            // (Memory only has to be aligned to the device's sector size.)
+            if (iov[1].iov_len > 0 && end1 == start2) {
+                iov[0].iov_len += iov[1].iov_len;
+                iov[1].iov_len = 0;
+            }
+            w_assert1(file_offset % io_unit == 0);
+            w_assert1(((uintptr_t) iov[0].iov_base) % 512 == 0);
+            w_assert1(iov[1].iov_len == 0 || iov[0].iov_len % io_unit == 0);
+
+            size_t tail = write_size % io_unit;
+            auto& last = iov[1].iov_len > 0 ? iov[1] : iov[0];
+            last.iov_len -= tail;
+            char* bounce = _owner->_bounce_buf;
+            memcpy(bounce, (char*) last.iov_base + last.iov_len, tail);
+            memcpy(bounce + tail, &_skip_logrec, _skip_logrec.length());
+            size_t bounce_len = ceil2(tail + _skip_logrec.length(), io_unit);
+            memset(bounce + tail + _skip_logrec.length(), 0,
+                    bounce_len - tail - _skip_logrec.length());
+            iov[2] = { bounce, bounce_len };
+            total = write_size - tail + bounce_len;
+        }
 
-        if(grand_total == log_storage::BLOCK_SIZE) {
+        if(total <= io_unit) {
             // 1-block flush
             // INC_TSTAT(log_short_flush);
         } else {
@@ -176,33 +222,29 @@ void partition_t::flush(
             // INC_TSTAT(log_long_flush);
         }
 
-        // CS FINELINE TODO: this is a temporary solution for the log priming problem.
-        // For now, we set the PID of the skip log record as the file offset and
-        // look for that when initializing the log.
-        _skip_logrec.set_pid(file_offset + write_size);
-
-        struct iovec iov[] = {
-            // iovec_t expects void* not const void *
-            { (char*)buf+start1,                static_cast<size_t>(end1-start1) },
-            // iovec_t expects void* not const void *
-            { (char*)buf+start2,                static_cast<size_t>(end2-start2) },
-            { &_skip_logrec,                    _skip_logrec.length()},
-            { block_of_zeros(),         static_cast<size_t>(grand_total-total) },
-        };
-
-        auto ret = ::writev(_fhdl, iov, 4);
+        // Data is durable once the write returns, without an fdatasync
+        // (O_DSYNC only for this write, not preallocation)
+        int flags = direct ? RWF_DSYNC : 0;
+        auto ret = backend->pwritev(_fhdl, iov, 3, file_offset, flags);
         CHECK_ERRNO(ret);
 
-        // ADD_TSTAT(log_bytes_written, grand_total);
+        // ADD_TSTAT(log_bytes_written, total);
+        _owner->count_flush(size, total, write_size - size);
     } // end copy skip record
 
-    fsync_delayed(_fhdl); // fsync
+    if (!direct) {
+        // File size never changes after open and preallocate (ftruncate),
+        // so the inode metadata doesn't have to be synced with every flush
+        auto ret = backend->fdatasync(_fhdl);
+        CHECK_ERRNO(ret);
+    }
 }
 
 void partition_t::read(logrec_t *&rp, lsn_t &ll)
 {
     w_assert1(ll.hi() == num());
-    w_assert1(is_open());
+    // Partitions are opened lazily (see log_storage::get_partition)
+    if (!is_open()) { open(); }
 
     size_t pos = ll.lo();
     rp = reinterpret_cast<logrec_t*>(_readbuf + pos);
@@ -210,8 +252,16 @@ void partition_t::read(logrec_t *&rp, lsn_t &ll)
 
 size_t partition_t::read_block(void* buf, size_t count, off_t offset)
 {
-    w_assert0(is_open());
-    auto bytesRead = ::pread(_fhdl, buf, count, offset);
+    if (!is_open()) { open(); }
+    if (_owner->get_direct_io()) {
+        // Direct reads would require an aligned buffer, offset and count;
+        // the mapping sees direct writes, since they invalidate the cached
+        // pages they overwrite
+        w_assert0(offset + count <= _max_partition_size);
+        memcpy(buf, _readbuf + offset, count);
+        return count;
+    }
+    auto bytesRead = _owner->get_backend()->pread(_fhdl, buf, count, offset);
     CHECK_ERRNO(bytesRead);
 
     return bytesRead;
@@ -221,60 +271,196 @@ void partition_t::open()
 {
     unique_lock<mutex> lck(_mutex);
     if (is_open()) { return; }
-    string fname = _owner->make_log_name(_num);
-    int fd, flags = O_RDWR | O_CREAT;
-    fd = ::open(fname.c_str(), flags, 0744 /*mode*/);
-    CHECK_ERRNO(fd);
-    auto res = ::ftruncate(fd, _max_partition_size);
+    open_file(_owner->make_log_name(_num), O_RDWR | O_CREAT);
+    auto res = _owner->get_backend()->ftruncate(_fhdl, _max_partition_size);
     CHECK_ERRNO(res);
+    map_file();
+    DBG(<< "opened_log_file " << _num);
+}
+
+void partition_t::open_file(const string& fname, int flags)
+{
+    if (_owner->get_direct_io()) { flags |= O_DIRECT; }
+    int fd = _owner->get_backend()->open(fname, flags, 0744 /*mode*/);
+    if (fd < 0 && errno == EINVAL && (flags & O_DIRECT)) {
+        throw std::runtime_error("Log directory does not support direct I/O: "
+                + _owner->_logpath.string());
+    }
+    CHECK_ERRNO(fd);
     w_assert3(_fhdl == invalid_fhdl);
     _fhdl = fd;
-    _readbuf = reinterpret_cast<char*>(
-            mmap(nullptr, _max_partition_size, PROT_READ, MAP_SHARED, _fhdl, 0));
-    CHECK_ERRNO((long) _readbuf);
-    DBG(<< "opened_log_file " << _num);
 }
 
-// CS TODO: why is this definition here?
-int partition_t::_artificial_flush_delay = 0;
+void partition_t::map_file()
+{
+    _readbuf = _owner->get_backend()->mmap(_fhdl, _max_partition_size);
+    CHECK_ERRNO((long) _readbuf);
+}
 
-void partition_t::fsync_delayed(int fd)
+void partition_t::preallocate(bool prezero, const string& recycled)
 {
-    static int64_t attempt_flush_delay = 0;
-    // We only cound the fsyncs called as
-    // a result of flush(), not from peek
-    // or start-up
-    // INC_TSTAT(log_fsync_cnt);
-
-    auto ret = ::fsync(fd);
-    CHECK_ERRNO(ret);
-
-    if (_artificial_flush_delay > 0) {
-        if (attempt_flush_delay==0) {
-            w_assert1(_artificial_flush_delay < 99999999/1000);
-            attempt_flush_delay = _artificial_flush_delay * 1000;
+    unique_lock<mutex> lck(_mutex);
+    w_assert0(!is_open());
+    auto& backend = _owner->get_backend();
+    string fname = _owner->make_prealloc_name(_num);
+    if (recycled.empty()) {
+        open_file(fname, O_RDWR | O_CREAT | O_TRUNC);
+    }
+    else {
+        // Blocks of a recycled file are already allocated (fallocate below
+        // is then cheap), but its old contents must not be taken as log
+        // records, so at least the first block is overwritten with zeroes
+        backend->rename(recycled, fname);
+        open_file(fname, O_RDWR);
+        // Partition size may have changed since the file was used
+        auto ret = backend->ftruncate(_fhdl, _max_partition_size);
+        CHECK_ERRNO(ret);
+        if (!prezero) {
+            ret = backend->pwrite(_fhdl, block_of_zeros(), log_storage::BLOCK_SIZE, 0);
+            CHECK_ERRNO(ret);
         }
-        struct timespec req, rem;
-        req.tv_sec = 0;
-        req.tv_nsec = attempt_flush_delay;
+    }
+    _staged = true;
 
-        struct timeval start;
-        gettimeofday(&start,0);
+    // Allocate blocks upfront, so that flushes don't pay for allocation
+    // metadata updates (falls back to a sparse file if not supported)
+    auto res = backend->fallocate(_fhdl, _max_partition_size);
+    if (res < 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+        res = backend->ftruncate(_fhdl, _max_partition_size);
+    }
+    CHECK_ERRNO(res);
 
-        while(nanosleep(&req, &rem) != 0) {
-            if (errno != EINTR)  break;
-            req = rem;
+    if (prezero) {
+        // Some filesystems still convert unwritten extents on the first
+        // write; writing zeroes avoids that
+        const int iovcnt = 1024;
+        struct iovec iov[iovcnt];
+        for (int i = 0; i < iovcnt; i++) {
+            iov[i] = { block_of_zeros(), log_storage::BLOCK_SIZE };
         }
+        off_t offset = 0;
+        while (offset < static_cast<off_t>(_max_partition_size)) {
+            auto ret = backend->pwritev(_fhdl, iov, iovcnt, offset);
+            CHECK_ERRNO(ret);
+            offset += ret;
+        }
+        // Restore the file size, which may have grown by the last write
+        res = backend->ftruncate(_fhdl, _max_partition_size);
+        CHECK_ERRNO(res);
+    }
+
+    res = backend->fdatasync(_fhdl);
+    CHECK_ERRNO(res);
+
+    map_file();
+    DBG(<< "preallocated_log_file " << _num);
+}
 
-        struct timeval stop;
-        gettimeofday(&stop,0);
-        int64_t diff = stop.tv_sec * 1000000 + stop.tv_usec;
-        diff -= start.tv_sec *       1000000 + start.tv_usec;
-        //diff is in micros.
-        diff *= 1000; // now it is nanos
-        attempt_flush_delay += ((_artificial_flush_delay * 1000) - diff)/8;
+void partition_t::activate()
+{
+    unique_lock<mutex> lck(_mutex);
+    w_assert0(_staged && is_open());
+    // Open descriptor and mapping remain valid after the rename
+    _owner->get_backend()->rename(_owner->make_prealloc_name(_num), _owner->make_log_name(_num));
+    _staged = false;
+    DBG(<< "activated_log_file " << _num);
+}
 
+/*
+ * Follows the chain of log records from pos up to (at least) until, and
+ * returns where it stopped, i.e., at the first position not holding a
+ * valid log record with a matching checksum, at the skip log record, or at
+ * the first record at or after until.
+ */
+long partition_t::scan_records(long pos, long until, bool& end_found) const
+{
+    const long max = _owner->get_partition_size();
+    end_found = true;
+    while (pos < until) {
+        if (pos + static_cast<long>(sizeof(baseLogHeader)) > max) { return pos; }
+        auto lr = reinterpret_cast<const logrec_t*>(_readbuf + pos);
+        if (!lr->valid_header() || pos + lr->length() > max) { return pos; }
+        if (!lr->valid_checksum(_num) || lr->is_eof()) { return pos; }
+        pos += lr->length();
     }
+    end_found = false;
+    return pos;
+}
+
+/*
+ * A log record may start at any aligned position, so chunks of the
+ * partition can be scanned in parallel: each thread looks for the first
+ * position in its chunk holding a log record with a matching checksum and
+ * follows the chain from there. Then the chains are stitched together from
+ * the beginning of the partition; if the true chain enters a chunk at a
+ * position other than the one found by its thread (i.e., the checksum of
+ * some bytes inside a log record matched by chance), that chunk is scanned
+ * again serially. Chunks beyond the end of the log are given up quickly,
+ * since any chain must have a record start within MaxLogrecSize bytes.
+ */
+long partition_t::find_end()
+{
+    if (!is_open()) { open(); }
+
+    auto first = reinterpret_cast<const logrec_t*>(_readbuf);
+    // Nothing was ever flushed if the first record is not valid
+    if (!first->valid_header()) { return 0; }
+    // Torn first flush or log of an older format
+    if (!first->valid_checksum(_num)) { return -1; }
+
+    const long max = _owner->get_partition_size();
+    unsigned threads = 1;
+    if (max >= MIN_PARALLEL_SCAN) {
+        threads = std::min(MAX_SCAN_THREADS, std::max(1u, std::thread::hardware_concurrency()));
+    }
+    const long chunk = ((max / threads) + LogrecAlignment - 1) & ~(LogrecAlignment - 1);
+
+    struct ChunkScan {
+        long begin = -1; // first record start found in the chunk
+        long end = -1;
+        bool end_found = false;
+    };
+    std::vector<ChunkScan> scans(threads);
+
+    auto scan_chunk = [&](unsigned i) {
+        long cbegin = i * chunk;
+        long cend = std::min(max, cbegin + chunk);
+        long limit = std::min(cend, cbegin + static_cast<long>(logrec_t::MaxLogrecSize));
+        for (long pos = cbegin; pos < limit; pos += LogrecAlignment) {
+            auto lr = reinterpret_cast<const logrec_t*>(_readbuf + pos);
+            if (lr->valid_header() && pos + lr->length() <= max
+                    && lr->valid_checksum(_num))
+            {
+                scans[i].begin = pos;
+                scans[i].end = scan_records(pos, cend, scans[i].end_found);
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++) { workers.emplace_back(scan_chunk, i); }
+    // First chunk always starts with a record
+    scans[0].begin = 0;
+    scans[0].end = scan_records(0, std::min(max, chunk), scans[0].end_found);
+    for (auto& t : workers) { t.join(); }
+
+    long pos = 0;
+    for (unsigned i = 0; i < threads; i++) {
+        long cend = std::min(max, (i + 1) * chunk);
+        // A record from a previous chunk may span this one entirely
+        if (pos >= cend) { continue; }
+        bool end_found;
+        if (scans[i].begin == pos) {
+            end_found = scans[i].end_found;
+            pos = scans[i].end;
+        }
+        else {
+            pos = scan_records(pos, cend, end_found);
+        }
+        if (end_found) { return pos; }
+    }
+    return pos < max ? pos : -1;
 }
 
 void partition_t::close()
@@ -283,10 +469,10 @@ void partition_t::close()
 
     if (is_open()) {
         // Caller must guarantee thread safety (log_storage::delete_old_partitions)
-        auto ret = munmap(_readbuf, _max_partition_size);
+        auto ret = _owner->get_backend()->munmap(_readbuf, _max_partition_size);
         CHECK_ERRNO(ret);
         _readbuf = nullptr;
-        ret = ::close(_fhdl);
+        ret = _owner->get_backend()->close(_fhdl);
         CHECK_ERRNO(ret);
         _fhdl = invalid_fhdl;
 
@@ -295,9 +481,14 @@ void partition_t::close()
         DBG(<< "closed_log_file " << _num);
     }
 
-    if (_delete_after_close) {
-	fs::path f = _owner->make_log_name(_num);
-	fs::remove(f);
+    string f = _staged ? _owner->make_prealloc_name(_num) : _owner->make_log_name(_num);
+    if (_recycle_after_close) {
+        _owner->recycle_file(f, _num);
+        _recycle_after_close = false;
+        DBG(<< "recycled_log_file " << _num);
+    }
+    else if (_delete_after_close) {
+	_owner->get_backend()->remove(f);
         // CS TODO
         // Logger::log_sys<comment_log>("deleted_log_file " + to_string(_num));
         DBG(<< "deleted_log_file " << _num);
@@ -80,6 +80,31 @@ public:
     void open();
     void close();
 
+    /*
+     * Creates and opens the file of a partition that is not yet in use,
+     * under a staging name, with all its blocks allocated (and optionally
+     * zeroed), so that the flush daemon does not pay for it on rollover.
+     * activate() gives it the final name once it becomes the current
+     * partition. If a recycled file is given (see mark_for_recycling), it is
+     * reused instead of creating a new one.
+     */
+    void preallocate(bool prezero, const std::string& recycled = "");
+    void activate();
+    bool is_staged() const { return _staged; }
+
+    /*
+     * Scans the partition for the end of the log, i.e., the skip log record
+     * written after the last flush (see flush) or the first log record whose
+     * checksum does not match (e.g., of a torn flush), and returns its
+     * offset. Returns -1 if the partition holds no usable log (e.g., it is
+     * full or its first record is damaged).
+     */
+    long find_end();
+
+    // Last access, used to close the least recently used partitions
+    uint64_t last_access() const { return _last_access; }
+    void touch(uint64_t tick) { _last_access = tick; }
+
     void read(logrec_t *&r, lsn_t &ll);
 
     size_t read_block(void* buf, size_t count, off_t offset);
@@ -93,18 +118,24 @@ public:
     }
 
     void mark_for_deletion() { _delete_after_close = true; }
+    // File is handed over to the owner's pool of recycled files on close
+    void mark_for_recycling() { _recycle_after_close = true; }
 
 private:
     partition_number_t    _num;
     log_storage*          _owner;
     int                   _fhdl;
-    static int            _artificial_flush_delay;  // in microseconds
     char*                 _readbuf;
     bool _delete_after_close;
+    bool _recycle_after_close;
+    bool _staged;
+    std::atomic<uint64_t> _last_access;
 
     size_t _max_partition_size;
 
-    void             fsync_delayed(int fd);
+    long             scan_records(long pos, long until, bool& end_found) const;
+    void             open_file(const std::string& fname, int flags);
+    void             map_file();
 
     // Serialize open and close calls
     std::mutex _mutex;
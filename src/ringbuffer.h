@@ -2,11 +2,11 @@
 #define FINELOG_RINGBUFFER_H
 
 #include "finelog_basics.h"
+#include "futex.h"
+#include "mirrored_buffer.h"
 
-#include <mutex>
-#include <condition_variable>
 #include <atomic>
-#include <chrono>
+#include <memory>
 
 /**
  * Simple implementation of a circular IO buffer for the archiver reader,
@@ -18,12 +18,12 @@
  * synchronization much simpler. In the case of a read buffer, the producer
  * is the reader thread and the consumer is the sorting thread (with the
  * log scanner), which inserts log records into the heap for replacement
- * selection. In a write buffer, the producer is the sorting thread, while
- * the consumer writes blocks to the current run.
+ * selection. (See AsyncRingBufferMPMC for a variant with several producers
+ * or consumers.)
  *
  * The allocation of buffer blocks (by both producers and consumers)
  * must be done in two stages:
- * 1) Request a block, waiting on a condvar if buffer is empty/full
+ * 1) Request a block, waiting if buffer is empty/full
  * 2) Once done, release it to the other producer/consumer thread
  *
  * Requests could be implemented in a single step if we copy
@@ -32,106 +32,277 @@
  * releasing, and that they request and release blocks in an ordered
  * behavior.
  *
+ * Head and tail are monotonically increasing counters, each one written by
+ * only one side, so no locks are required. Threads only sleep (on a futex)
+ * when the buffer is empty or full.
+ *
+ * Each block may have a fixed-size metadata area, kept in a separate array
+ * (see getMetadata), so that producers can pass information about a block
+ * to the consumer without reserving space in the block itself.
+ *
+ * If the buffer is mirrored (see MirroredBuffer), the first block follows
+ * the last one in virtual memory, so that data crossing the boundary of
+ * two consecutive blocks is always contiguous (see consumerRequestNext).
+ *
  * Author: Caetano Sauer
  *
  */
-class AsyncRingBuffer {
+class RingBufferBase {
 public:
-    char* producerRequest();
-    void producerRelease();
-    char* consumerRequest();
-    void consumerRelease();
-
-    bool isFull() { return begin == end && bparity != eparity; }
-    bool isEmpty() { return begin == end && bparity == eparity; }
     size_t getBlockSize() { return blockSize; }
+    size_t getMetadataSize() { return metadataSize; }
     size_t getBlockCount() { return blockCount; }
-    void set_finished(bool f = true) { finished = f; }
     bool isFinished() { return finished.load(); }
+    bool isMirrored() { return mirror != nullptr; }
 
-    AsyncRingBuffer(size_t bsize, size_t bcount)
-        : begin(0), end(0), bparity(true), eparity(true),
-        blockSize(bsize), blockCount(bcount)
+    // Waiting threads are woken up and return NULL (consumers only once the
+    // buffer is empty)
+    void set_finished(bool f = true)
     {
-        buf = new char[blockCount * blockSize];
+        finished = f;
+        notEmpty.signal();
+        notFull.signal();
     }
 
-    ~AsyncRingBuffer()
+    // Metadata area of the given block, which must have been returned by
+    // producerRequest or consumerRequest
+    char* getMetadata(const char* block)
     {
-        delete[] buf;
+        w_assert1(metadata);
+        return metadata.get() + getIndex(block) * metadataSize;
     }
 
-private:
-    char * buf;
-    int begin;
-    int end;
-    bool bparity;
-    bool eparity;
+protected:
+    RingBufferBase(size_t bsize, size_t bcount, size_t mdsize, bool mirrored)
+        : blockSize(bsize), blockCount(bcount), metadataSize(mdsize)
+    {
+        if (mirrored) {
+            mirror.reset(new MirroredBuffer(blockCount * blockSize));
+            buf = mirror->data();
+        }
+        else {
+            ownBuf.reset(new char[blockCount * blockSize]);
+            buf = ownBuf.get();
+        }
+        if (mdsize > 0) { metadata.reset(new char[blockCount * metadataSize]); }
+    }
+
+    char* getBlock(uint64_t pos)
+    {
+        return buf + (pos % blockCount) * blockSize;
+    }
+
+    size_t getIndex(const char* block)
+    {
+        w_assert1(block >= buf && block < buf + blockCount * blockSize);
+        return (block - buf) / blockSize;
+    }
+
+    // Sleep on the given event while cond holds and the buffer is not
+    // finished
+    template <typename Cond>
+    void waitWhile(FutexEvent& event, Cond cond)
+    {
+        while (cond() && !finished) {
+            auto ticket = event.prepare();
+            if (!cond() || finished) {
+                event.cancel();
+                break;
+            }
+            event.wait(ticket);
+        }
+    }
+
+    char* buf;
+    std::unique_ptr<char[]> ownBuf;
+    std::unique_ptr<MirroredBuffer> mirror;
+    std::unique_ptr<char[]> metadata;
     std::atomic<bool> finished{false};
 
     const size_t blockSize;
     const size_t blockCount;
+    const size_t metadataSize;
+
+    alignas(CACHELINE_SIZE) FutexEvent notEmpty;
+    alignas(CACHELINE_SIZE) FutexEvent notFull;
+};
 
-    std::mutex mtx;
-    std::condition_variable cond;
+class AsyncRingBuffer : public RingBufferBase {
+public:
+    char* producerRequest();
+    void producerRelease();
+    char* consumerRequest();
+    void consumerRelease();
+    // Block after the one returned by consumerRequest, which remains held
+    char* consumerRequestNext();
 
-    bool wait(pthread_cond_t*, bool isProducer);
+    bool isFull() { return tail.load() - head.load() == blockCount; }
+    bool isEmpty() { return head.load() == tail.load(); }
 
-    void increment(int& p, bool& parity) {
-        p = (p + 1) % blockCount;
-        if (p == 0) {
-            parity = !parity;
-        }
+    AsyncRingBuffer(size_t bsize, size_t bcount, size_t mdsize = 0, bool mirrored = false)
+        : RingBufferBase(bsize, bcount, mdsize, mirrored), head(0), tail(0)
+    {
     }
+
+private:
+    // Next block to be consumed; only written by the consumer
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> head;
+    // Next block to be produced; only written by the producer
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> tail;
 };
 
 inline char* AsyncRingBuffer::producerRequest()
 {
-    using namespace std::chrono_literals;
-    std::unique_lock<std::mutex> lck{mtx};
-    while (isFull() && !finished) {
-        cond.wait_for(lck, 100ms, [this] { return finished || !isFull(); });
-    }
+    waitWhile(notFull, [this] { return isFull(); });
     if (finished) {
         return NULL;
     }
-    return buf + (end * blockSize);
+    return getBlock(tail.load(std::memory_order_relaxed));
 }
 
 inline void AsyncRingBuffer::producerRelease()
 {
-    std::unique_lock<std::mutex> lck{mtx};
-    bool wasEmpty = isEmpty();
-    increment(end, eparity);
-
-    if (wasEmpty) {
-        cond.notify_one();
-    }
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    notEmpty.signal();
 }
 
 inline char* AsyncRingBuffer::consumerRequest()
 {
-    using namespace std::chrono_literals;
-    std::unique_lock<std::mutex> lck{mtx};
-    while (isEmpty() && !finished) {
-        cond.wait_for(lck, 100ms, [this] { return finished || !isEmpty(); });
-    }
+    waitWhile(notEmpty, [this] { return isEmpty(); });
     // Consumer doesn't finish until the queue is empty
-    if (finished && !isEmpty()) {
+    if (isEmpty()) {
+        return NULL;
+    }
+    return getBlock(head.load(std::memory_order_relaxed));
+}
+
+inline char* AsyncRingBuffer::consumerRequestNext()
+{
+    w_assert1(blockCount > 1);
+    auto available = [this] { return tail.load() - head.load(); };
+    waitWhile(notEmpty, [&] { return available() < 2; });
+    if (available() < 2) {
         return NULL;
     }
-    return buf + (begin * blockSize);
+    return getBlock(head.load(std::memory_order_relaxed) + 1);
 }
 
 inline void AsyncRingBuffer::consumerRelease()
 {
-    std::unique_lock<std::mutex> lck{mtx};
-    bool wasFull = isFull();
-    increment(begin, bparity);
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    notFull.signal();
+}
+
+/**
+ * Variant of AsyncRingBuffer that may be shared by several producers and
+ * consumers. Blocks are still handed out in order, but since one thread
+ * may not know which blocks the others hold, blocks must be given back on
+ * release. Each block has a sequence number which tells whether it may be
+ * produced or consumed (as in Vyukov's bounded MPMC queue), and positions
+ * are claimed with a CAS on head or tail.
+ */
+class AsyncRingBufferMPMC : public RingBufferBase {
+public:
+    char* producerRequest();
+    void producerRelease(char* block);
+    char* consumerRequest();
+    void consumerRelease(char* block);
+
+    bool isFull() { return tail.load() - head.load() >= blockCount; }
+    bool isEmpty() { return head.load() == tail.load(); }
+
+    AsyncRingBufferMPMC(size_t bsize, size_t bcount, size_t mdsize = 0, bool mirrored = false)
+        : RingBufferBase(bsize, bcount, mdsize, mirrored), slots(new Slot[bcount]), head(0), tail(0)
+    {
+        for (size_t i = 0; i < blockCount; i++) {
+            slots[i].seq = i;
+        }
+    }
+
+private:
+    /*
+     * For the block at position pos (modulo blockCount), seq == pos means it
+     * may be produced and seq == pos + 1 means it may be consumed. Lower
+     * values mean it is still held by a thread of the previous round.
+     */
+    struct alignas(CACHELINE_SIZE) Slot {
+        std::atomic<uint64_t> seq;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> head;
+    alignas(CACHELINE_SIZE) std::atomic<uint64_t> tail;
+
+    static int64_t diff(uint64_t seq, uint64_t expected)
+    {
+        return static_cast<int64_t>(seq - expected);
+    }
+};
+
+inline char* AsyncRingBufferMPMC::producerRequest()
+{
+    auto blocked = [this] {
+        auto pos = tail.load();
+        return diff(slots[pos % blockCount].seq.load(), pos) < 0;
+    };
+
+    while (!finished) {
+        auto pos = tail.load(std::memory_order_relaxed);
+        auto d = diff(slots[pos % blockCount].seq.load(std::memory_order_acquire), pos);
+        if (d == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                return getBlock(pos);
+            }
+        }
+        else if (d < 0) {
+            waitWhile(notFull, blocked);
+        }
+        // otherwise another producer claimed the block
+    }
+    return NULL;
+}
+
+inline void AsyncRingBufferMPMC::producerRelease(char* block)
+{
+    auto& slot = slots[getIndex(block)];
+    slot.seq.store(slot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    notEmpty.signal();
+}
+
+inline char* AsyncRingBufferMPMC::consumerRequest()
+{
+    auto blocked = [this] {
+        auto pos = head.load();
+        return diff(slots[pos % blockCount].seq.load(), pos + 1) < 0;
+    };
 
-    if (wasFull) {
-        cond.notify_one();
+    while (true) {
+        auto pos = head.load(std::memory_order_relaxed);
+        auto d = diff(slots[pos % blockCount].seq.load(std::memory_order_acquire), pos + 1);
+        if (d == 0) {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                return getBlock(pos);
+            }
+        }
+        else if (d < 0) {
+            // Consumers don't finish until the queue is empty
+            if (finished && isEmpty()) {
+                return NULL;
+            }
+            // Even if finished, a producer may still hold the next block
+            auto ticket = notEmpty.prepare();
+            if (blocked() && !(finished && isEmpty())) { notEmpty.wait(ticket); }
+            else { notEmpty.cancel(); }
+        }
     }
 }
 
+inline void AsyncRingBufferMPMC::consumerRelease(char* block)
+{
+    auto& slot = slots[getIndex(block)];
+    slot.seq.store(slot.seq.load(std::memory_order_relaxed) + blockCount - 1,
+            std::memory_order_release);
+    notFull.signal();
+}
+
 #endif
@@ -0,0 +1,576 @@
+#include "storage_backend.h"
+
+#include "finelog_basics.h"
+
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef FINELOG_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define BOOST_FILESYSTEM_NO_DEPRECATED
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+
+std::shared_ptr<StorageBackend> StorageBackend::create(const std::string& name)
+{
+    if (name == "posix") {
+        return std::make_shared<PosixBackend>();
+    }
+    if (name == "io_uring") {
+#ifdef FINELOG_HAVE_LIBURING
+        return std::make_shared<UringBackend>();
+#else
+        throw std::runtime_error("Storage backend io_uring requires liburing");
+#endif
+    }
+    if (name == "memory") {
+        return std::make_shared<MemoryBackend>();
+    }
+    throw std::runtime_error("Unknown storage backend: " + name);
+}
+
+int PosixBackend::open(const std::string& path, int flags, mode_t mode)
+{
+    return ::open(path.c_str(), flags, mode);
+}
+
+int PosixBackend::close(int fd)
+{
+    return ::close(fd);
+}
+
+ssize_t PosixBackend::pread(int fd, void* buf, size_t count, off_t offset)
+{
+    return ::pread(fd, buf, count, offset);
+}
+
+ssize_t PosixBackend::pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset,
+        int flags)
+{
+#ifndef FINELOG_NO_PWRITEV2
+    return ::pwritev2(fd, iov, iovcnt, offset, flags);
+#else
+    auto ret = ::pwritev(fd, iov, iovcnt, offset);
+    if (ret >= 0 && flags != 0 && ::fdatasync(fd) < 0) { return -1; }
+    return ret;
+#endif
+}
+
+ssize_t PosixBackend::write(int fd, const void* buf, size_t count)
+{
+    return ::write(fd, buf, count);
+}
+
+int PosixBackend::fsync(int fd)
+{
+    return ::fsync(fd);
+}
+
+int PosixBackend::fdatasync(int fd)
+{
+    return ::fdatasync(fd);
+}
+
+int PosixBackend::ftruncate(int fd, off_t length)
+{
+    return ::ftruncate(fd, length);
+}
+
+int PosixBackend::fallocate(int fd, off_t length)
+{
+    return ::fallocate(fd, 0, 0, length);
+}
+
+off_t PosixBackend::file_size(int fd)
+{
+    struct stat st;
+    auto ret = ::fstat(fd, &st);
+    if (ret < 0) { return -1; }
+    return st.st_size;
+}
+
+char* PosixBackend::mmap(int fd, size_t length)
+{
+    return static_cast<char*>(::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0));
+}
+
+int PosixBackend::munmap(char* addr, size_t length)
+{
+    return ::munmap(addr, length);
+}
+
+bool PosixBackend::exists(const std::string& path)
+{
+    return fs::exists(path);
+}
+
+void PosixBackend::create_directories(const std::string& path)
+{
+    fs::create_directories(path);
+}
+
+void PosixBackend::list_directory(const std::string& path, std::vector<std::string>& names)
+{
+    names.clear();
+    fs::directory_iterator it(path), eod;
+    for (; it != eod; it++) {
+        names.push_back(it->path().filename().string());
+    }
+}
+
+void PosixBackend::rename(const std::string& from, const std::string& to)
+{
+    fs::rename(from, to);
+}
+
+void PosixBackend::remove(const std::string& path)
+{
+    fs::remove(path);
+}
+
+#ifdef FINELOG_HAVE_LIBURING
+
+namespace {
+
+struct ThreadRing {
+    struct io_uring ring;
+    bool ok;
+
+    ThreadRing()
+    {
+        ok = io_uring_queue_init(UringBackend::RING_DEPTH, &ring, 0) == 0;
+    }
+
+    ~ThreadRing()
+    {
+        if (ok) { io_uring_queue_exit(&ring); }
+    }
+};
+
+struct io_uring* thread_ring()
+{
+    thread_local ThreadRing tr;
+    return tr.ok ? &tr.ring : nullptr;
+}
+
+// Submits one request and waits for it; result as in the POSIX call
+template <typename Prep>
+ssize_t uring_call(struct io_uring* ring, Prep prep)
+{
+    auto sqe = io_uring_get_sqe(ring);
+    w_assert0(sqe);
+    prep(sqe);
+    int ret = io_uring_submit_and_wait(ring, 1);
+    if (ret < 0) { errno = -ret; return -1; }
+
+    struct io_uring_cqe* cqe;
+    ret = io_uring_wait_cqe(ring, &cqe);
+    if (ret < 0) { errno = -ret; return -1; }
+    int res = cqe->res;
+    io_uring_cqe_seen(ring, cqe);
+
+    if (res < 0) { errno = -res; return -1; }
+    return res;
+}
+
+} // anonymous namespace
+
+ssize_t UringBackend::pread(int fd, void* buf, size_t count, off_t offset)
+{
+    auto ring = thread_ring();
+    if (!ring) { return PosixBackend::pread(fd, buf, count, offset); }
+    return uring_call(ring, [&](struct io_uring_sqe* sqe) {
+        io_uring_prep_read(sqe, fd, buf, count, offset);
+    });
+}
+
+ssize_t UringBackend::pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset,
+        int flags)
+{
+    auto ring = thread_ring();
+    if (!ring) { return PosixBackend::pwritev(fd, iov, iovcnt, offset, flags); }
+    return uring_call(ring, [&](struct io_uring_sqe* sqe) {
+        io_uring_prep_writev(sqe, fd, iov, iovcnt, offset);
+        sqe->rw_flags = flags;
+    });
+}
+
+int UringBackend::fsync(int fd)
+{
+    auto ring = thread_ring();
+    if (!ring) { return PosixBackend::fsync(fd); }
+    return uring_call(ring, [&](struct io_uring_sqe* sqe) {
+        io_uring_prep_fsync(sqe, fd, 0);
+    });
+}
+
+int UringBackend::fdatasync(int fd)
+{
+    auto ring = thread_ring();
+    if (!ring) { return PosixBackend::fdatasync(fd); }
+    return uring_call(ring, [&](struct io_uring_sqe* sqe) {
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+    });
+}
+
+#endif // FINELOG_HAVE_LIBURING
+
+MemoryBackend::File::~File()
+{
+    if (data) { ::munmap(data, capacity); }
+}
+
+/*
+ * Memory is reserved without being committed (MAP_NORESERVE), so that a
+ * file truncated to the size of a log partition only uses the memory that
+ * is actually written. It is moved when it grows, unless it is mapped.
+ */
+bool MemoryBackend::File::reserve(size_t length)
+{
+    if (length <= capacity) { return true; }
+    if (mappings > 0) { return false; }
+
+    size_t newCapacity = ((length + CAPACITY_UNIT - 1) / CAPACITY_UNIT) * CAPACITY_UNIT;
+    void* addr;
+    if (data) {
+        addr = ::mremap(data, capacity, newCapacity, MREMAP_MAYMOVE);
+    }
+    else {
+        addr = ::mmap(nullptr, newCapacity, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (addr == MAP_FAILED) { return false; }
+    data = static_cast<char*>(addr);
+    capacity = newCapacity;
+    return true;
+}
+
+bool MemoryBackend::File::truncate(size_t length)
+{
+    if (!reserve(length)) { return false; }
+    size_t old = size;
+    if (length < old) {
+        // Discarded bytes must read as zeroes if the file grows again;
+        // whole pages are simply given back
+        size_t page = ::sysconf(_SC_PAGESIZE);
+        size_t from = std::min(old, (length + page - 1) & ~(page - 1));
+        memset(data + length, 0, from - length);
+        if (from < old) {
+            ::madvise(data + from, ((old + page - 1) & ~(page - 1)) - from, MADV_DONTNEED);
+        }
+    }
+    size = length;
+    return true;
+}
+
+void MemoryBackend::File::extend(size_t length)
+{
+    auto current = size.load();
+    while (length > current && !size.compare_exchange_weak(current, length)) {}
+}
+
+std::string MemoryBackend::normalize(const std::string& path)
+{
+    auto p = fs::path(path).lexically_normal();
+    // Trailing separator yields a "." component
+    if (p.filename() == ".") { p = p.parent_path(); }
+    return p.string();
+}
+
+std::shared_ptr<MemoryBackend::File> MemoryBackend::get_file(int fd)
+{
+    std::unique_lock<std::mutex> lck(mutex);
+    auto it = openFiles.find(fd);
+    if (it == openFiles.end()) {
+        errno = EBADF;
+        return nullptr;
+    }
+    return it->second.file;
+}
+
+int MemoryBackend::open(const std::string& path, int flags, mode_t)
+{
+    std::unique_lock<std::mutex> lck(mutex);
+    auto name = normalize(path);
+    auto it = files.find(name);
+    if (it == files.end()) {
+        if (!(flags & O_CREAT)) {
+            errno = ENOENT;
+            return -1;
+        }
+        it = files.emplace(name, std::make_shared<File>()).first;
+    }
+    else if (flags & O_TRUNC) {
+        std::unique_lock<std::shared_mutex> latch(it->second->latch);
+        it->second->truncate(0);
+    }
+
+    int fd = nextFd++;
+    openFiles[fd] = OpenFile{it->second, flags, 0};
+    return fd;
+}
+
+int MemoryBackend::close(int fd)
+{
+    std::unique_lock<std::mutex> lck(mutex);
+    if (openFiles.erase(fd) == 0) {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t MemoryBackend::pread(int fd, void* buf, size_t count, off_t offset)
+{
+    auto file = get_file(fd);
+    if (!file) { return -1; }
+
+    std::shared_lock<std::shared_mutex> latch(file->latch);
+    size_t size = file->size;
+    if (static_cast<size_t>(offset) >= size) { return 0; }
+    count = std::min(count, size - offset);
+    memcpy(buf, file->data + offset, count);
+    return count;
+}
+
+ssize_t MemoryBackend::write_at(File& file, const struct iovec* iov, int iovcnt, off_t offset)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) { total += iov[i].iov_len; }
+    size_t end = offset + total;
+
+    auto copy = [&] {
+        char* dest = file.data + offset;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+            dest += iov[i].iov_len;
+        }
+        file.extend(end);
+    };
+
+    {
+        std::shared_lock<std::shared_mutex> latch(file.latch);
+        if (end <= file.capacity) {
+            copy();
+            return total;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> latch(file.latch);
+    if (!file.reserve(end)) {
+        errno = EFBIG;
+        return -1;
+    }
+    copy();
+    return total;
+}
+
+ssize_t MemoryBackend::pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset, int)
+{
+    auto file = get_file(fd);
+    if (!file) { return -1; }
+    return write_at(*file, iov, iovcnt, offset);
+}
+
+ssize_t MemoryBackend::write(int fd, const void* buf, size_t count)
+{
+    // Latch held throughout, so that appends don't overlap
+    std::unique_lock<std::mutex> lck(mutex);
+    auto it = openFiles.find(fd);
+    if (it == openFiles.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    auto& of = it->second;
+    if (of.flags & O_APPEND) { of.pos = of.file->size; }
+
+    struct iovec iov = { const_cast<void*>(buf), count };
+    auto ret = write_at(*of.file, &iov, 1, of.pos);
+    if (ret > 0) { of.pos += ret; }
+    return ret;
+}
+
+int MemoryBackend::ftruncate(int fd, off_t length)
+{
+    auto file = get_file(fd);
+    if (!file) { return -1; }
+
+    std::unique_lock<std::shared_mutex> latch(file->latch);
+    if (!file->truncate(length)) {
+        errno = EFBIG;
+        return -1;
+    }
+    return 0;
+}
+
+int MemoryBackend::fallocate(int fd, off_t length)
+{
+    auto file = get_file(fd);
+    if (!file) { return -1; }
+
+    std::unique_lock<std::shared_mutex> latch(file->latch);
+    if (!file->reserve(length)) {
+        errno = EFBIG;
+        return -1;
+    }
+    file->extend(length);
+    return 0;
+}
+
+off_t MemoryBackend::file_size(int fd)
+{
+    auto file = get_file(fd);
+    if (!file) { return -1; }
+    return file->size;
+}
+
+char* MemoryBackend::mmap(int fd, size_t length)
+{
+    auto file = get_file(fd);
+    if (!file) { return static_cast<char*>(MAP_FAILED); }
+
+    {
+        std::unique_lock<std::shared_mutex> latch(file->latch);
+        // Mapped data must not move, so capacity for the whole mapping is
+        // reserved now
+        if (!file->reserve(length)) {
+            errno = ENOMEM;
+            return static_cast<char*>(MAP_FAILED);
+        }
+        file->mappings++;
+    }
+
+    std::unique_lock<std::mutex> lck(mutex);
+    mappings.emplace(file->data, file);
+    return file->data;
+}
+
+int MemoryBackend::munmap(char* addr, size_t)
+{
+    std::shared_ptr<File> file;
+    {
+        std::unique_lock<std::mutex> lck(mutex);
+        auto it = mappings.find(addr);
+        if (it == mappings.end()) {
+            errno = EINVAL;
+            return -1;
+        }
+        file = it->second;
+        mappings.erase(it);
+    }
+    file->mappings--;
+    return 0;
+}
+
+bool MemoryBackend::exists(const std::string& path)
+{
+    std::unique_lock<std::mutex> lck(mutex);
+    auto name = normalize(path);
+    if (files.count(name) > 0 || directories.count(name) > 0) { return true; }
+    // Directory implied by a file in it
+    auto it = files.lower_bound(name + "/");
+    return it != files.end() && it->first.compare(0, name.length() + 1, name + "/") == 0;
+}
+
+void MemoryBackend::create_directories(const std::string& path)
+{
+    std::unique_lock<std::mutex> lck(mutex);
+    directories.insert(normalize(path));
+}
+
+void MemoryBackend::list_directory(const std::string& path, std::vector<std::string>& names)
+{
+    names.clear();
+    std::unique_lock<std::mutex> lck(mutex);
+    auto dir = normalize(path);
+    for (auto& f : files) {
+        fs::path p(f.first);
+        if (p.parent_path().string() == dir) {
+            names.push_back(p.filename().string());
+        }
+    }
+}
+
+void MemoryBackend::rename(const std::string& from, const std::string& to)
+{
+    std::unique_lock<std::mutex> lck(mutex);
+    auto it = files.find(normalize(from));
+    if (it == files.end()) {
+        throw std::runtime_error("MemoryBackend: cannot rename missing file " + from);
+    }
+    auto file = it->second;
+    files.erase(it);
+    files[normalize(to)] = file;
+}
+
+void MemoryBackend::remove(const std::string& path)
+{
+    std::unique_lock<std::mutex> lck(mutex);
+    files.erase(normalize(path));
+}
+
+void DelayBackend::delay(unsigned latencyUs, size_t bytes, size_t mbps)
+{
+    auto cost = std::chrono::duration<double, std::micro>(latencyUs);
+    if (mbps > 0) {
+        // MB (2^20 bytes) per second
+        cost += std::chrono::duration<double, std::micro>(bytes * 1e6 / (mbps * 1048576.0));
+    }
+
+    clock::time_point done;
+    {
+        std::unique_lock<std::mutex> lck(mutex);
+        auto start = std::max(clock::now(), busyUntil);
+        done = start + std::chrono::duration_cast<clock::duration>(cost);
+        busyUntil = done;
+    }
+    std::this_thread::sleep_until(done);
+}
+
+ssize_t DelayBackend::pread(int fd, void* buf, size_t count, off_t offset)
+{
+    auto ret = inner->pread(fd, buf, count, offset);
+    if (ret > 0) { delay(model.readLatencyUs, ret, model.readMBps); }
+    return ret;
+}
+
+ssize_t DelayBackend::pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset,
+        int flags)
+{
+    auto ret = inner->pwritev(fd, iov, iovcnt, offset, flags);
+    if (ret > 0) {
+        unsigned latency = model.writeLatencyUs;
+        // Write is only complete once it is durable
+        if (flags != 0) { latency += model.syncLatencyUs; }
+        delay(latency, ret, model.writeMBps);
+    }
+    return ret;
+}
+
+ssize_t DelayBackend::write(int fd, const void* buf, size_t count)
+{
+    auto ret = inner->write(fd, buf, count);
+    if (ret > 0) { delay(model.writeLatencyUs, ret, model.writeMBps); }
+    return ret;
+}
+
+int DelayBackend::fsync(int fd)
+{
+    auto ret = inner->fsync(fd);
+    if (ret == 0) { delay(model.syncLatencyUs, 0, 0); }
+    return ret;
+}
+
+int DelayBackend::fdatasync(int fd)
+{
+    auto ret = inner->fdatasync(fd);
+    if (ret == 0) { delay(model.syncLatencyUs, 0, 0); }
+    return ret;
+}
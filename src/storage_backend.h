@@ -0,0 +1,274 @@
+#ifndef FINELOG_STORAGE_BACKEND_H
+#define FINELOG_STORAGE_BACKEND_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <set>
+#include <chrono>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifndef RWF_DSYNC
+// pwritev2 not available; PosixBackend issues an fdatasync instead
+#define FINELOG_NO_PWRITEV2 1
+#define RWF_DSYNC 0x00000002
+#endif
+
+#if defined(__has_include)
+#if __has_include(<liburing.h>)
+// Applications must then link with -luring
+#define FINELOG_HAVE_LIBURING 1
+#endif
+#endif
+
+/**
+ * \brief Files used by the log (partitions) and the log archive (runs,
+ * manifest, checkpoints, and spill files).
+ *
+ * Calls mirror their POSIX counterparts, including flags (e.g., O_CREAT,
+ * RWF_DSYNC) and error reporting (-1 or MAP_FAILED with errno set), so that
+ * callers can check them with CHECK_ERRNO. Name-based operations (exists,
+ * rename, etc.) throw on errors, like boost::filesystem. mmap always
+ * creates a read-only shared mapping of the first length bytes of a file,
+ * which must reflect later writes to the file.
+ *
+ * Besides the plain POSIX implementation, there is an io_uring one (if
+ * liburing is available), an in-memory one, which is useful to measure CPU
+ * costs without a device, and a wrapper that adds latency and bandwidth
+ * limits to another backend, to emulate a slower device.
+ *
+ * A backend is chosen when the log is created (see LogManager) and shared
+ * by all components that access its files (see log_storage::get_backend).
+ */
+class StorageBackend {
+public:
+    virtual ~StorageBackend() {}
+
+    virtual int open(const std::string& path, int flags, mode_t mode = 0744) = 0;
+    virtual int close(int fd) = 0;
+
+    virtual ssize_t pread(int fd, void* buf, size_t count, off_t offset) = 0;
+    // flags as in pwritev2 (only RWF_DSYNC is supported)
+    virtual ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset,
+            int flags = 0) = 0;
+    // Writes at the file position, i.e., at the end if opened with O_APPEND
+    virtual ssize_t write(int fd, const void* buf, size_t count) = 0;
+    virtual int fsync(int fd) = 0;
+    virtual int fdatasync(int fd) = 0;
+
+    virtual int ftruncate(int fd, off_t length) = 0;
+    // Allocates blocks up to length; errno is EOPNOTSUPP if not supported
+    virtual int fallocate(int fd, off_t length) = 0;
+    virtual off_t file_size(int fd) = 0;
+
+    virtual char* mmap(int fd, size_t length) = 0;
+    virtual int munmap(char* addr, size_t length) = 0;
+
+    virtual bool exists(const std::string& path) = 0;
+    virtual void create_directories(const std::string& path) = 0;
+    // File names (not paths) in the given directory
+    virtual void list_directory(const std::string& path, std::vector<std::string>& names) = 0;
+    virtual void rename(const std::string& from, const std::string& to) = 0;
+    // Does nothing if the file does not exist
+    virtual void remove(const std::string& path) = 0;
+
+    ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset, int flags = 0)
+    {
+        struct iovec iov = { const_cast<void*>(buf), count };
+        return pwritev(fd, &iov, 1, offset, flags);
+    }
+
+    // Backend with the given name: "posix", "io_uring", or "memory"
+    static std::shared_ptr<StorageBackend> create(const std::string& name = "posix");
+};
+
+class PosixBackend : public StorageBackend {
+public:
+    int open(const std::string& path, int flags, mode_t mode = 0744) override;
+    int close(int fd) override;
+
+    ssize_t pread(int fd, void* buf, size_t count, off_t offset) override;
+    ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset,
+            int flags = 0) override;
+    ssize_t write(int fd, const void* buf, size_t count) override;
+    int fsync(int fd) override;
+    int fdatasync(int fd) override;
+
+    int ftruncate(int fd, off_t length) override;
+    int fallocate(int fd, off_t length) override;
+    off_t file_size(int fd) override;
+
+    char* mmap(int fd, size_t length) override;
+    int munmap(char* addr, size_t length) override;
+
+    bool exists(const std::string& path) override;
+    void create_directories(const std::string& path) override;
+    void list_directory(const std::string& path, std::vector<std::string>& names) override;
+    void rename(const std::string& from, const std::string& to) override;
+    void remove(const std::string& path) override;
+};
+
+#ifdef FINELOG_HAVE_LIBURING
+/**
+ * Reads, writes, and syncs are submitted to an io_uring instead of issued
+ * as system calls. Each thread has its own ring, and each call still waits
+ * for its completion. If a ring cannot be created (e.g., io_uring is
+ * disabled in the kernel), calls fall back to the POSIX ones.
+ */
+class UringBackend : public PosixBackend {
+public:
+    ssize_t pread(int fd, void* buf, size_t count, off_t offset) override;
+    ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset,
+            int flags = 0) override;
+    int fsync(int fd) override;
+    int fdatasync(int fd) override;
+
+    static const unsigned RING_DEPTH = 8;
+};
+#endif
+
+/**
+ * Files are kept in (anonymous) memory and never persisted, so that the
+ * log can be exercised without any device costs. Paths are only compared
+ * as strings, and directories only exist if created explicitly (or
+ * implicitly by creating a file in them).
+ *
+ * Files may grow while they are mapped only up to their capacity, which is
+ * rounded up to CAPACITY_UNIT.
+ */
+class MemoryBackend : public StorageBackend {
+public:
+    MemoryBackend() : nextFd(0) {}
+
+    int open(const std::string& path, int flags, mode_t mode = 0744) override;
+    int close(int fd) override;
+
+    ssize_t pread(int fd, void* buf, size_t count, off_t offset) override;
+    ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset,
+            int flags = 0) override;
+    ssize_t write(int fd, const void* buf, size_t count) override;
+    int fsync(int) override { return 0; }
+    int fdatasync(int) override { return 0; }
+
+    int ftruncate(int fd, off_t length) override;
+    int fallocate(int fd, off_t length) override;
+    off_t file_size(int fd) override;
+
+    char* mmap(int fd, size_t length) override;
+    int munmap(char* addr, size_t length) override;
+
+    bool exists(const std::string& path) override;
+    void create_directories(const std::string& path) override;
+    void list_directory(const std::string& path, std::vector<std::string>& names) override;
+    void rename(const std::string& from, const std::string& to) override;
+    void remove(const std::string& path) override;
+
+    static const size_t CAPACITY_UNIT = 1024 * 1024;
+
+private:
+    struct File {
+        // Exclusive only to move or shrink the data, so that reads and
+        // writes of different threads may copy data concurrently
+        std::shared_mutex latch;
+        char* data = nullptr;
+        size_t capacity = 0;
+        std::atomic<size_t> size{0};
+        std::atomic<unsigned> mappings{0};
+        ~File();
+        // Caller must hold the latch in exclusive mode
+        bool reserve(size_t length);
+        bool truncate(size_t length);
+        // Caller must hold the latch (in any mode)
+        void extend(size_t length);
+    };
+    struct OpenFile {
+        std::shared_ptr<File> file;
+        int flags;
+        off_t pos;
+    };
+
+    // Files stay alive while open or mapped, even if removed
+    std::map<std::string, std::shared_ptr<File>> files;
+    std::map<int, OpenFile> openFiles;
+    std::multimap<char*, std::shared_ptr<File>> mappings;
+    std::set<std::string> directories;
+    int nextFd;
+    // Protects the maps above, but not the file contents
+    std::mutex mutex;
+
+    ssize_t write_at(File& file, const struct iovec* iov, int iovcnt, off_t offset);
+    std::shared_ptr<File> get_file(int fd);
+    static std::string normalize(const std::string& path);
+};
+
+/**
+ * \brief Emulates a slower device on top of another backend.
+ *
+ * Each read or write takes a fixed latency plus its size divided by the
+ * bandwidth, and each sync takes a fixed latency. Requests are served one
+ * at a time, in the order they arrive, so that delays add up as in a
+ * device with a single queue and are reproducible across machines, as
+ * long as the emulated device is slower than the actual one. Reads through
+ * mappings are not delayed.
+ */
+class DelayBackend : public StorageBackend {
+public:
+    struct DeviceModel {
+        unsigned readLatencyUs = 0;
+        unsigned writeLatencyUs = 0;
+        unsigned syncLatencyUs = 0;
+        // Zero means unlimited
+        size_t readMBps = 0;
+        size_t writeMBps = 0;
+    };
+
+    DelayBackend(std::shared_ptr<StorageBackend> inner, const DeviceModel& model)
+        : inner(inner), model(model), busyUntil(clock::now())
+    {}
+
+    int open(const std::string& path, int flags, mode_t mode = 0744) override
+    { return inner->open(path, flags, mode); }
+    int close(int fd) override { return inner->close(fd); }
+
+    ssize_t pread(int fd, void* buf, size_t count, off_t offset) override;
+    ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t offset,
+            int flags = 0) override;
+    ssize_t write(int fd, const void* buf, size_t count) override;
+    int fsync(int fd) override;
+    int fdatasync(int fd) override;
+
+    int ftruncate(int fd, off_t length) override { return inner->ftruncate(fd, length); }
+    int fallocate(int fd, off_t length) override { return inner->fallocate(fd, length); }
+    off_t file_size(int fd) override { return inner->file_size(fd); }
+
+    char* mmap(int fd, size_t length) override { return inner->mmap(fd, length); }
+    int munmap(char* addr, size_t length) override { return inner->munmap(addr, length); }
+
+    bool exists(const std::string& path) override { return inner->exists(path); }
+    void create_directories(const std::string& path) override
+    { inner->create_directories(path); }
+    void list_directory(const std::string& path, std::vector<std::string>& names) override
+    { inner->list_directory(path, names); }
+    void rename(const std::string& from, const std::string& to) override
+    { inner->rename(from, to); }
+    void remove(const std::string& path) override { inner->remove(path); }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    std::shared_ptr<StorageBackend> inner;
+    const DeviceModel model;
+    clock::time_point busyUntil;
+    std::mutex mutex;
+
+    // Waits until a request of the given cost would be completed
+    void delay(unsigned latencyUs, size_t bytes, size_t mbps);
+};
+
+#endif
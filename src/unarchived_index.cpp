@@ -0,0 +1,69 @@
+#include "unarchived_index.h"
+
+using namespace std;
+
+UnarchivedIndex::UnarchivedIndex(size_t partitionCount)
+    : partitionCount(partitionCount), truncatedRun(0), lastAddedRun(0),
+    lastAddedPartitions(nullptr)
+{
+    w_assert0(partitionCount > 0);
+}
+
+UnarchivedIndex::~UnarchivedIndex()
+{
+}
+
+void UnarchivedIndex::add(PageID pid, lsn_t lsn, run_number_t run)
+{
+    w_assert1(run > truncatedRun);
+
+    if (run != lastAddedRun || !lastAddedPartitions) {
+        spinlock_write_critical_section cs(&runsLatch);
+        auto& entries = runs[run];
+        if (!entries.partitions) {
+            entries.partitions.reset(new Partition[partitionCount]);
+        }
+        lastAddedRun = run;
+        lastAddedPartitions = entries.partitions.get();
+    }
+
+    // Runs are only erased by truncate, which is also called by the writer,
+    // so the cached pointer is still valid here
+    auto& p = getPartition(lastAddedPartitions, pid);
+    spinlock_write_critical_section cs(&p.latch);
+    p.lsns[pid].push_back(lsn);
+}
+
+bool UnarchivedIndex::collect(PageID pid, run_number_t afterRun, vector<lsn_t>& lsns) const
+{
+    spinlock_read_critical_section cs(&runsLatch);
+
+    if (truncatedRun > afterRun) { return false; }
+
+    for (auto it = runs.upper_bound(afterRun); it != runs.end(); it++) {
+        auto& p = getPartition(it->second.partitions.get(), pid);
+        spinlock_read_critical_section pcs(&p.latch);
+        auto found = p.lsns.find(pid);
+        if (found != p.lsns.end()) {
+            lsns.insert(lsns.end(), found->second.begin(), found->second.end());
+        }
+    }
+
+    return true;
+}
+
+void UnarchivedIndex::truncate(run_number_t lastArchivedRun)
+{
+    if (lastArchivedRun <= truncatedRun) { return; }
+
+    spinlock_write_critical_section cs(&runsLatch);
+
+    auto end = runs.upper_bound(lastArchivedRun);
+    for (auto it = runs.begin(); it != end; it++) {
+        if (it->second.partitions.get() == lastAddedPartitions) {
+            lastAddedPartitions = nullptr;
+        }
+    }
+    runs.erase(runs.begin(), end);
+    truncatedRun = lastArchivedRun;
+}
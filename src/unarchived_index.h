@@ -0,0 +1,103 @@
+#ifndef FINELOG_UNARCHIVED_INDEX_H
+#define FINELOG_UNARCHIVED_INDEX_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "finelog_basics.h"
+#include "latches.h"
+#include "lsn.h"
+#include "futex.h"
+
+/** \brief In-memory index of redo log records not yet in a closed archive run
+ *
+ * Maps page IDs to the LSNs of durable redo log records that the log archiver
+ * has already consumed but which are not yet visible in the log archive
+ * index, i.e., whose run was not closed yet. It allows fetching the most
+ * recent history of a page (e.g., in NodeFetch) without forcing the archiver
+ * to close its current run with requestFlushSync.
+ *
+ * Entries are grouped by run number, and each group is a hash table
+ * partitioned by PID, so that lookups from many threads do not contend on a
+ * single latch. Once a run is closed in the archive, its whole group is
+ * dropped at once with truncate().
+ *
+ * Records are only added once the archiver consumes them, so the writer also
+ * publishes up to which LSN all durable records were added. Readers that
+ * need the newest history of a page must wait for it to reach the durable
+ * LSN (see NodeFetch::apply).
+ *
+ * The index has a single writer (the log archiver) and many readers.
+ */
+class UnarchivedIndex
+{
+public:
+    UnarchivedIndex(size_t partitionCount = DFT_PARTITION_COUNT);
+    ~UnarchivedIndex();
+
+    void add(PageID pid, lsn_t lsn, run_number_t run);
+
+    /*
+     * Appends to lsns the LSNs of all records of the given PID that belong to
+     * runs after afterRun, in LSN order. Returns false if some of those runs
+     * were already truncated, in which case the caller must probe the archive
+     * index again before relying on the result.
+     */
+    bool collect(PageID pid, run_number_t afterRun, std::vector<lsn_t>& lsns) const;
+
+    // Drop all entries of runs up to the given one (inclusive)
+    void truncate(run_number_t lastArchivedRun);
+
+    run_number_t getTruncatedRun() const { return truncatedRun; }
+
+    // All records before the given LSN were added
+    void publishIndexedLSN(lsn_t lsn) { indexedLSN.publish(lsn.data()); }
+    lsn_t getIndexedLSN() const { return lsn_t(indexedLSN.get()); }
+
+    /*
+     * Wait until all records before the given LSN were added or the timeout
+     * expires; returns the current indexed LSN. Spurious returns are
+     * possible, so callers should wait in a loop. Negative timeout means no
+     * timeout.
+     */
+    lsn_t waitForIndexedLSN(lsn_t lsn, long timeoutMs = -1)
+    {
+        return lsn_t(indexedLSN.waitFor(lsn.data(), timeoutMs));
+    }
+
+    const static size_t DFT_PARTITION_COUNT = 64;
+
+private:
+    struct alignas(CACHELINE_SIZE) Partition {
+        mutable srwlock_t latch;
+        std::unordered_map<PageID, std::vector<lsn_t>> lsns;
+    };
+
+    struct RunEntries {
+        std::unique_ptr<Partition[]> partitions;
+    };
+
+    const size_t partitionCount;
+
+    std::map<run_number_t, RunEntries> runs;
+    mutable srwlock_t runsLatch;
+
+    // All runs up to this one were dropped
+    std::atomic<run_number_t> truncatedRun;
+
+    SeqNotifier indexedLSN;
+
+    // Used by the writer only, to avoid looking up the run on every add
+    run_number_t lastAddedRun;
+    Partition* lastAddedPartitions;
+
+    Partition& getPartition(Partition* partitions, PageID pid) const
+    {
+        return partitions[pid % partitionCount];
+    }
+};
+
+#endif